@@ -0,0 +1,118 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Synthetic JIT process for the benchmarks
+
+   Maps executable memory, emits N functions of SIZE bytes and writes a
+   /tmp/perf-$pid.map with M entries. The first N entries describe the
+   functions; the other ones describe fake functions after the code (they
+   are only useful for the map parser and the symbol lookups).
+
+   The PID is printed on stdout once the map is written. The process exits
+   when its standard input is closed.
+
+   Usage: unjit_fakejit [N [SIZE [M]]]
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Emit some code (a mix of common instructions) ending with a call and a ret:
+static void emit_function(std::uint8_t* code, std::size_t size,
+  std::uint8_t* target)
+{
+  static const std::uint8_t instructions[][8] = {
+    {3, 0x48, 0x89, 0xc8},             // mov %rcx, %rax
+    {4, 0x48, 0x83, 0xc0, 0x01},       // add $1, %rax
+    {4, 0x48, 0x8d, 0x14, 0x08},       // lea (%rax,%rcx), %rdx
+    {3, 0x48, 0x31, 0xd2},             // xor %rdx, %rdx
+    {4, 0x48, 0x0f, 0xaf, 0xc1},       // imul %rcx, %rax
+    {4, 0x48, 0x8b, 0x47, 0x08},       // mov 0x8(%rdi), %rax
+    {1, 0x90},                         // nop
+  };
+  const std::size_t count = sizeof(instructions) / sizeof(instructions[0]);
+
+  std::size_t i = 0, j = 0;
+  code[i++] = 0x55;                      // push %rbp
+  while (size >= 7 && i + instructions[j][0] <= size - 6) {
+    std::memcpy(code + i, instructions[j] + 1, instructions[j][0]);
+    i += instructions[j][0];
+    j = (j + 1) % count;
+  }
+  if (size >= 7) {
+    std::int32_t rel = (std::int32_t) (target - (code + i + 5));
+    code[i++] = 0xe8;                    // call target
+    std::memcpy(code + i, &rel, 4);
+    i += 4;
+  }
+  while (i < size - 1)
+    code[i++] = 0x90;
+  code[size - 1] = 0xc3;                 // ret
+}
+
+int main(int argc, const char** argv)
+{
+  std::size_t n = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 10000;
+  std::size_t size = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 256;
+  std::size_t m = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : n;
+  if (n == 0 || size < 2) {
+    std::fprintf(stderr, "Bad arguments\n");
+    return 1;
+  }
+
+  void* res = mmap(nullptr, n * size, PROT_READ | PROT_WRITE | PROT_EXEC,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (res == MAP_FAILED) {
+    std::perror("mmap");
+    return 1;
+  }
+  std::uint8_t* code = (std::uint8_t*) res;
+  for (std::size_t i = 0; i != n; ++i)
+    emit_function(code + i * size, size, code + ((i + 1) % n) * size);
+
+  char filename[64];
+  std::snprintf(filename, sizeof(filename), "/tmp/perf-%ld.map", (long) getpid());
+  FILE* file = std::fopen(filename, "w");
+  if (!file) {
+    std::perror(filename);
+    return 1;
+  }
+  for (std::size_t i = 0; i != m; ++i)
+    std::fprintf(file, "%" PRIxPTR " %zx fake_jit_function_%zu\n",
+      (std::uintptr_t) (code + i * size), size, i);
+  std::fclose(file);
+
+  std::printf("%ld\n", (long) getpid());
+  std::fflush(stdout);
+
+  // Wait for the benchmark to close our stdin:
+  char buffer[64];
+  while (read(STDIN_FILENO, buffer, sizeof(buffer)) > 0);
+  unlink(filename);
+  return 0;
+}
@@ -0,0 +1,147 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Microbenchmark of the /proc/${pid}/maps parser
+
+   Compares parse_vm_maps() with the former std::regex based parser on a
+   synthetic maps file.
+
+   Usage: unjit_maps_bench [lines]
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cinttypes>
+
+#include <chrono>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+
+#include "../src/unjit.hpp"
+
+using unjit::Vma;
+
+static std::string generate_maps(std::size_t lines)
+{
+  std::string res;
+  char line[256];
+  std::uint64_t address = 0x7f0000000000;
+  for (std::size_t i = 0; i != lines; ++i) {
+    std::uint64_t size = 0x1000 * (1 + i % 16);
+    if (i % 4 == 0)
+      snprintf(line, sizeof(line),
+        "%" PRIx64 "-%" PRIx64 " rw-p 00000000 00:00 0 \n",
+        address, address + size);
+    else
+      snprintf(line, sizeof(line),
+        "%" PRIx64 "-%" PRIx64 " r-xp %08zx fd:01 %zu"
+        "                      /usr/lib/x86_64-linux-gnu/libsomething-%zu.so\n",
+        address, address + size, (i % 7) * 0x1000, 1000000 + i, i / 4);
+    res += line;
+    address += size;
+  }
+  return res;
+}
+
+// The parser which was used before parse_vm_maps():
+static void parse_vm_maps_regex(std::string const& data, std::vector<Vma>& vmas)
+{
+  std::regex map_regex(
+    "^([0-9a-f]+)-([0-9a-f]+)"
+    " ([r-])([w-])([x-])([p-])"
+    " ([0-9a-f]+)"
+    " [0-9a-f]+:[0-9a-f]+"
+    " [0-9]*"
+    " *(.*)$"
+  );
+  std::istringstream file(data);
+  std::string line;
+  std::smatch match;
+  while (getline(file, line)) {
+    if (!std::regex_search(line, match, map_regex))
+      continue;
+    Vma vma;
+    vma.start  = strtoll(match[1].str().c_str(), nullptr, 16);
+    vma.end    = strtoll(match[2].str().c_str(), nullptr, 16);
+    vma.prot   = 0;
+    if (match[3].str()[0] == 'r')
+      vma.prot |= PROT_READ;
+    if (match[4].str()[0] == 'w')
+      vma.prot |= PROT_WRITE;
+    if (match[5].str()[0] == 'x')
+      vma.prot |= PROT_EXEC;
+    if (match[6].str()[0] == 'p')
+      vma.flags = MAP_PRIVATE;
+    else
+      vma.flags = MAP_SHARED;
+    vma.offset = strtoll(match[7].str().c_str(), nullptr, 16);
+    vma.name   = match[8];
+    vmas.push_back(std::move(vma));
+  }
+}
+
+template<class F>
+static double measure(F f)
+{
+  auto start = std::chrono::steady_clock::now();
+  f();
+  auto stop = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(stop - start).count();
+}
+
+int main(int argc, const char** argv)
+{
+  std::size_t lines = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 200000;
+  std::string data = generate_maps(lines);
+
+  std::vector<Vma> vmas_regex, vmas_parser;
+  double regex_time = measure([&]() {
+    parse_vm_maps_regex(data, vmas_regex);
+  });
+  double parser_time = measure([&]() {
+    unjit::parse_vm_maps(data.data(), data.size(), vmas_parser);
+  });
+
+  bool same = vmas_regex.size() == vmas_parser.size();
+  for (std::size_t i = 0; same && i != vmas_regex.size(); ++i)
+    same = vmas_regex[i].start == vmas_parser[i].start
+      && vmas_regex[i].end == vmas_parser[i].end
+      && vmas_regex[i].prot == vmas_parser[i].prot
+      && vmas_regex[i].flags == vmas_parser[i].flags
+      && vmas_regex[i].offset == vmas_parser[i].offset
+      && vmas_regex[i].name == vmas_parser[i].name;
+
+  printf("lines: %zu\n", lines);
+  printf("regex:  %.3f s (%.0f lines/s)\n", regex_time, lines / regex_time);
+  printf("parser: %.3f s (%.0f lines/s)\n", parser_time, lines / parser_time);
+  printf("speedup: %.1fx\n", regex_time / parser_time);
+  if (!same) {
+    fprintf(stderr, "Error, the parsers disagree\n");
+    return 1;
+  }
+  return 0;
+}
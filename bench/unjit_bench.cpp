@@ -0,0 +1,275 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Benchmark of the main phases of unjit
+
+   Starts a synthetic JIT process (unjit_fakejit, expected next to this
+   program) and measures the throughput of each phase. Each result is
+   written as a JSON object on its own line so that the results can be
+   tracked over time.
+
+   Usage: unjit_bench [functions [size [entries]]]
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cinttypes>
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <llvm-c/Target.h>
+
+#include "../src/unjit.hpp"
+
+namespace {
+
+struct Params {
+  std::size_t functions, size, entries;
+};
+
+class FakeJit {
+private:
+  pid_t pid_ = -1;
+  pid_t target_ = -1;
+  int input_ = -1;
+public:
+  FakeJit(Params const& params);
+  ~FakeJit();
+  pid_t pid() const { return target_; }
+};
+
+FakeJit::FakeJit(Params const& params)
+{
+  // The helper lives next to the benchmark:
+  char path[4096];
+  ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+  if (len < 0)
+    throw std::runtime_error("Could not find the benchmark executable");
+  path[len] = '\0';
+  std::string helper(path);
+  helper = helper.substr(0, helper.rfind('/') + 1) + "unjit_fakejit";
+
+  std::string functions = std::to_string(params.functions);
+  std::string size = std::to_string(params.size);
+  std::string entries = std::to_string(params.entries);
+
+  int input[2], output[2];
+  if (pipe(input) != 0 || pipe(output) != 0)
+    throw std::runtime_error("Could not create pipes");
+  pid_ = fork();
+  if (pid_ < 0)
+    throw std::runtime_error("Could not fork");
+  if (pid_ == 0) {
+    dup2(input[0], STDIN_FILENO);
+    dup2(output[1], STDOUT_FILENO);
+    close(input[0]);
+    close(input[1]);
+    close(output[0]);
+    close(output[1]);
+    execl(helper.c_str(), helper.c_str(), functions.c_str(), size.c_str(),
+      entries.c_str(), (char*) nullptr);
+    std::perror(helper.c_str());
+    _exit(127);
+  }
+  close(input[0]);
+  close(output[1]);
+  input_ = input[1];
+
+  // Wait for the map to be written:
+  std::string line;
+  char c;
+  while (::read(output[0], &c, 1) == 1 && c != '\n')
+    line += c;
+  close(output[0]);
+  if (line.empty())
+    throw std::runtime_error("Could not start " + helper);
+  target_ = std::atol(line.c_str());
+}
+
+FakeJit::~FakeJit()
+{
+  if (input_ >= 0)
+    close(input_);
+  if (pid_ > 0)
+    waitpid(pid_, nullptr, 0);
+}
+
+template<class F>
+double measure(F f)
+{
+  auto start = std::chrono::steady_clock::now();
+  f();
+  auto stop = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(stop - start).count();
+}
+
+void report(Params const& params, const char* name, const char* unit,
+  std::uint64_t items, double seconds)
+{
+  std::printf("{\"benchmark\":\"%s\",\"functions\":%zu,\"size\":%zu,"
+    "\"entries\":%zu,\"unit\":\"%s\",\"items\":%" PRIu64 ","
+    "\"seconds\":%.6f,\"rate\":%.1f}\n",
+    name, params.functions, params.size, params.entries, unit, items,
+    seconds, seconds > 0 ? items / seconds : 0.0);
+  std::fflush(stdout);
+}
+
+}
+
+int main(int argc, const char** argv)
+{
+  Params params;
+  params.functions = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 10000;
+  params.size = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 256;
+  params.entries = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : params.functions;
+
+  LLVMInitializeAllTargetInfos();
+  LLVMInitializeAllTargetMCs();
+  LLVMInitializeAllDisassemblers();
+  LLVMInitializeNativeDisassembler();
+
+  try {
+    FakeJit fakejit(params);
+    pid_t pid = fakejit.pid();
+    const unsigned repeat = 20;
+
+    // Parse /proc/$pid/maps:
+    std::uint64_t lines = 0;
+    double seconds = measure([&]() {
+      for (unsigned i = 0; i != repeat; ++i) {
+        unjit::Process process(pid);
+        process.load_vm_maps();
+        lines += process.vmas().size();
+      }
+    });
+    report(params, "load_vm_maps", "lines", lines, seconds);
+
+    // Find the modules and parse their symbol tables:
+    std::uint64_t symbols = 0;
+    seconds = 0;
+    for (unsigned i = 0; i != 3; ++i) {
+      unjit::Process process(pid);
+      process.load_vm_maps();
+      seconds += measure([&]() {
+        process.load_modules();
+        process.load_all_symbols();
+      });
+      for (unjit::Module const& module : process.modules())
+        symbols += module.symbols->size();
+    }
+    report(params, "load_modules", "symbols", symbols, seconds);
+
+    // Parse the perf map:
+    symbols = 0;
+    seconds = 0;
+    for (unsigned i = 0; i != repeat; ++i) {
+      unjit::Process process(pid);
+      seconds += measure([&]() {
+        process.load_map_file();
+      });
+      symbols += process.jit_symbols().size();
+    }
+    report(params, "load_map_file", "symbols", symbols, seconds);
+
+    // The fully loaded process for the next phases:
+    unjit::Process process(pid);
+    process.load_vm_maps();
+    process.load_modules();
+    process.load_all_symbols();
+    process.load_map_file();
+    std::vector<unjit::Symbol> jit_symbols;
+    for (unjit::Symbol symbol : process.jit_symbols())
+      if (jit_symbols.size() != params.functions)
+        jit_symbols.push_back(symbol);
+    if (jit_symbols.empty())
+      throw std::runtime_error("No JIT symbol");
+    std::uint64_t code_start = jit_symbols.front().value;
+    std::uint64_t code_size = params.functions * params.size;
+    std::vector<std::uint64_t> module_symbols;
+    for (unjit::Module const& module : process.modules())
+      for (unjit::Symbol symbol : *module.symbols)
+        if (symbol.flags & SYMBOL_FLAG_CODE)
+          module_symbols.push_back(symbol.value + module.bias);
+
+    // Resolve addresses (3/4 in the JIT-ed code, 1/4 in the modules):
+    unjit::Disassembler disassembler(process);
+    const std::uint64_t lookups = 1000000;
+    std::uint64_t found = 0;
+    std::uint64_t random = 42;
+    seconds = measure([&]() {
+      for (std::uint64_t i = 0; i != lookups; ++i) {
+        random = random * 6364136223846793005ULL + 1442695040888963407ULL;
+        std::uint64_t address;
+        if (i % 4 != 3 || module_symbols.empty())
+          address = code_start + (random >> 16) % code_size;
+        else
+          address = module_symbols[(random >> 16) % module_symbols.size()] + 1;
+        if (disassembler.lookup_symbol(address))
+          ++found;
+      }
+    });
+    report(params, "lookup_symbol", "lookups", lookups, seconds);
+    if (found == 0)
+      throw std::runtime_error("No symbol found");
+
+    // Read the code of the JIT-ed functions:
+    std::uint64_t bytes = 0;
+    seconds = measure([&]() {
+      for (unsigned i = 0; i != repeat; ++i) {
+        unjit::BatchReader reader(pid);
+        std::size_t j = 0;
+        while (j != jit_symbols.size()) {
+          std::size_t k = reader.read(jit_symbols, j, unjit::batch_size);
+          for (; j != k; ++j)
+            if (reader.data(jit_symbols[j].value, jit_symbols[j].size))
+              bytes += jit_symbols[j].size;
+        }
+      }
+    });
+    report(params, "read", "bytes", bytes, seconds);
+
+    // Disassemble them (in memory):
+    unjit::Output output;
+    seconds = measure([&]() {
+      disassembler.disassemble(output, jit_symbols);
+    });
+    // Each function has a header line and a blank line:
+    std::uint64_t instructions = std::count(output.data(),
+      output.data() + output.size(), '\n') - 2 * jit_symbols.size();
+    report(params, "disassemble", "instructions", instructions, seconds);
+  }
+  catch (std::runtime_error& exception) {
+    std::fprintf(stderr, "%s\n", exception.what());
+    return 1;
+  }
+
+  return 0;
+}
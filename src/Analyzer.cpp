@@ -0,0 +1,346 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Static performance analysis (unjit --analyze)
+
+   This uses the scheduling model of the LLVM MC layer directly: the views
+   of llvm-mca (summary, resource pressure, bottlenecks) are not part of
+   the LLVM libraries. The analysed range is considered as the body of a
+   loop, as llvm-mca does.
+*/
+
+#include <cstdio>
+#include <cinttypes>
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+#include <llvm/Config/llvm-config.h>
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/Triple.h>
+#include <llvm/MC/MCAsmInfo.h>
+#include <llvm/MC/MCContext.h>
+#include <llvm/MC/MCDisassembler/MCDisassembler.h>
+#include <llvm/MC/MCInst.h>
+#include <llvm/MC/MCInstPrinter.h>
+#include <llvm/MC/MCInstrInfo.h>
+#include <llvm/MC/MCRegisterInfo.h>
+#include <llvm/MC/MCSchedule.h>
+#include <llvm/MC/MCSubtargetInfo.h>
+#include <llvm/MC/MCTargetOptions.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/MCA/Support.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "unjit.hpp"
+
+namespace unjit {
+
+// Number of simulated iterations for the loop-carried dependencies:
+static const unsigned simulated_iterations = 8;
+
+struct Analyzer::Impl {
+  std::string cpu;
+  std::unique_ptr<llvm::MCRegisterInfo> mri;
+  std::unique_ptr<llvm::MCAsmInfo> mai;
+  std::unique_ptr<llvm::MCSubtargetInfo> sti;
+  std::unique_ptr<llvm::MCInstrInfo> mcii;
+  std::unique_ptr<llvm::MCContext> context;
+  std::unique_ptr<llvm::MCDisassembler> disassembler;
+  std::unique_ptr<llvm::MCInstPrinter> printer;
+  llvm::SmallVector<std::uint64_t, 32> masks;
+};
+
+namespace {
+
+struct Instruction {
+  llvm::MCInst inst;
+  std::uint64_t address, size;
+  int latency;
+  double throughput;
+  unsigned micro_ops;
+  std::vector<unsigned> uses, defs; // register units
+  // In the first simulated iteration:
+  unsigned start, end;
+  int predecessor;
+};
+
+void add_units(llvm::MCRegisterInfo const& mri, unsigned reg, std::vector<unsigned>& units)
+{
+  if (reg == 0)
+    return;
+  for (llvm::MCRegUnitIterator unit(reg, &mri); unit.isValid(); ++unit)
+    units.push_back(*unit);
+}
+
+}
+
+Analyzer::Analyzer(std::string const& cpu, std::string const& features) :
+  impl_(new Impl())
+{
+  std::string error;
+  std::string triple = llvm::Triple::normalize(LLVM_HOST_TRIPLE);
+  const llvm::Target* target = llvm::TargetRegistry::lookupTarget(triple, error);
+  if (!target)
+    throw std::runtime_error("Could not find the LLVM target: " + error);
+
+  Impl& impl = *impl_;
+  impl.cpu = cpu;
+  llvm::MCTargetOptions options;
+  impl.mri.reset(target->createMCRegInfo(triple));
+  if (impl.mri)
+    impl.mai.reset(target->createMCAsmInfo(*impl.mri, triple, options));
+  impl.sti.reset(target->createMCSubtargetInfo(triple, cpu, features));
+  impl.mcii.reset(target->createMCInstrInfo());
+  if (!impl.mri || !impl.mai || !impl.sti || !impl.mcii)
+    throw std::runtime_error("Could not initialize the LLVM MC layer");
+  impl.context.reset(new llvm::MCContext(llvm::Triple(triple),
+    impl.mai.get(), impl.mri.get(), impl.sti.get()));
+  impl.disassembler.reset(target->createMCDisassembler(*impl.sti, *impl.context));
+  impl.printer.reset(target->createMCInstPrinter(llvm::Triple(triple),
+    impl.mai->getAssemblerDialect(), *impl.mai, *impl.mcii, *impl.mri));
+  if (!impl.disassembler || !impl.printer)
+    throw std::runtime_error("Could not initialize the LLVM MC layer");
+  if (!impl.sti->getSchedModel().hasInstrSchedModel())
+    throw std::runtime_error("No scheduling model for the CPU " + cpu);
+  impl.printer->setPrintBranchImmAsAddress(true);
+  impl.printer->setPrintImmHex(true);
+  impl.masks.resize(impl.sti->getSchedModel().getNumProcResourceKinds());
+  llvm::mca::computeProcResourceMasks(impl.sti->getSchedModel(), impl.masks);
+}
+
+Analyzer::~Analyzer()
+{
+}
+
+void Analyzer::analyze(Output& stream, Symbol const& symbol, const std::uint8_t* code)
+{
+  Impl& impl = *impl_;
+  llvm::MCSchedModel const& model = impl.sti->getSchedModel();
+  char temp[256];
+
+  stream.hex(symbol.value);
+  stream.write(" <", 2);
+  stream.write(symbol.name, symbol.name_size);
+  stream.write(">\n", 2);
+
+  // Decode the instructions and find their scheduling information:
+  std::vector<Instruction> instructions;
+  std::vector<unsigned> usage(model.getNumProcResourceKinds());
+  std::vector<double> pressure(model.getNumProcResourceKinds());
+  unsigned micro_ops = 0;
+  llvm::ArrayRef<std::uint8_t> bytes(code, symbol.size);
+  std::uint64_t offset = 0;
+  while (offset < symbol.size) {
+    Instruction instruction;
+    std::uint64_t size;
+    instruction.address = symbol.value + offset;
+    if (impl.disassembler->getInstruction(instruction.inst, size,
+        bytes.slice(offset), instruction.address, llvm::nulls())
+        != llvm::MCDisassembler::Success || size == 0) {
+      stream.write("\t; undecodable instruction at ");
+      stream.hex(instruction.address);
+      stream.put('\n');
+      break;
+    }
+    offset += size;
+    instruction.size = size;
+
+    llvm::MCInst const& inst = instruction.inst;
+    llvm::MCInstrDesc const& desc = impl.mcii->get(inst.getOpcode());
+    unsigned sched_class = desc.getSchedClass();
+    llvm::MCSchedClassDesc const* sched = model.getSchedClassDesc(sched_class);
+    while (sched && sched->isVariant()) {
+      sched_class = impl.sti->resolveVariantSchedClass(sched_class, &inst,
+        impl.mcii.get(), model.getProcessorID());
+      sched = sched_class ? model.getSchedClassDesc(sched_class) : nullptr;
+    }
+    instruction.latency = std::max(model.computeInstrLatency(*impl.sti, *impl.mcii, inst), 0);
+    instruction.throughput = model.getReciprocalThroughput(*impl.sti, *impl.mcii, inst);
+    instruction.micro_ops = 0;
+    if (sched && sched->isValid()) {
+      instruction.micro_ops = sched->NumMicroOps;
+      // The cycles of a resource are implied for the groups containing it
+      // (as in llvm-mca): keep only the additional cycles of the groups.
+      std::vector<std::pair<std::uint64_t, int> > resources;
+      std::vector<unsigned> indices;
+      for (auto i = impl.sti->getWriteProcResBegin(sched),
+          end = impl.sti->getWriteProcResEnd(sched); i != end; ++i) {
+        resources.push_back(std::make_pair(impl.masks[i->ProcResourceIdx], i->Cycles));
+        indices.push_back(i->ProcResourceIdx);
+      }
+      std::vector<std::size_t> order(resources.size());
+      for (std::size_t i = 0; i != order.size(); ++i)
+        order[i] = i;
+      std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+        unsigned x = llvm::countPopulation(resources[a].first);
+        unsigned y = llvm::countPopulation(resources[b].first);
+        return x != y ? x < y : resources[a].first < resources[b].first;
+      });
+      for (std::size_t i = 0; i != order.size(); ++i) {
+        std::uint64_t mask = resources[order[i]].first;
+        if (llvm::countPopulation(mask) > 1)
+          mask ^= llvm::PowerOf2Floor(mask);
+        for (std::size_t j = i + 1; j != order.size(); ++j)
+          if ((mask & resources[order[j]].first) == mask)
+            resources[order[j]].second -= resources[order[i]].second;
+      }
+      for (std::size_t i = 0; i != resources.size(); ++i) {
+        if (resources[i].second <= 0)
+          continue;
+        usage[indices[i]] += resources[i].second;
+        // The cycles of a group are spread over its units:
+        llvm::MCProcResourceDesc const* resource = model.getProcResource(indices[i]);
+        if (resource->SubUnitsIdxBegin)
+          for (unsigned j = 0; j != resource->NumUnits; ++j)
+            pressure[resource->SubUnitsIdxBegin[j]] += (double) resources[i].second / resource->NumUnits;
+        else
+          pressure[indices[i]] += resources[i].second;
+      }
+    }
+    micro_ops += instruction.micro_ops;
+
+    // Register dependencies (explicit and implicit operands):
+    for (unsigned i = 0; i != inst.getNumOperands(); ++i)
+      if (inst.getOperand(i).isReg())
+        add_units(*impl.mri, inst.getOperand(i).getReg(),
+          i < desc.getNumDefs() ? instruction.defs : instruction.uses);
+    for (unsigned i = 0; i != desc.getNumImplicitUses(); ++i)
+      add_units(*impl.mri, desc.getImplicitUses()[i], instruction.uses);
+    for (unsigned i = 0; i != desc.getNumImplicitDefs(); ++i)
+      add_units(*impl.mri, desc.getImplicitDefs()[i], instruction.defs);
+
+    instructions.push_back(std::move(instruction));
+  }
+  if (instructions.empty()) {
+    stream.put('\n');
+    return;
+  }
+
+  // Simulate the dependencies over a few iterations of the loop:
+  std::vector<unsigned> ready(impl.mri->getNumRegUnits());
+  std::vector<int> writer(impl.mri->getNumRegUnits(), -1);
+  unsigned finish = 0, finish_half = 0;
+  for (unsigned iteration = 0; iteration != simulated_iterations; ++iteration) {
+    for (std::size_t i = 0; i != instructions.size(); ++i) {
+      Instruction& instruction = instructions[i];
+      unsigned start = 0;
+      int predecessor = -1;
+      for (unsigned unit : instruction.uses)
+        if (ready[unit] > start) {
+          start = ready[unit];
+          predecessor = writer[unit];
+        }
+      unsigned end = start + instruction.latency;
+      for (unsigned unit : instruction.defs) {
+        ready[unit] = end;
+        writer[unit] = i;
+      }
+      finish = std::max(finish, end);
+      if (iteration == 0) {
+        instruction.start = start;
+        instruction.end = end;
+        instruction.predecessor = predecessor;
+      }
+    }
+    if (iteration + 1 == simulated_iterations / 2)
+      finish_half = finish;
+  }
+  double carried = (double) (finish - finish_half) / (simulated_iterations / 2);
+  double throughput = llvm::mca::computeBlockRThroughput(model, model.IssueWidth,
+    micro_ops, usage);
+
+  snprintf(temp, sizeof(temp), "\t; %zu instructions, %u micro-ops (cpu %s, issue width %u)\n",
+    instructions.size(), micro_ops, impl.cpu.c_str(), model.IssueWidth);
+  stream.write(temp);
+  snprintf(temp, sizeof(temp), "\t; block reciprocal throughput: %.2f cycles\n", throughput);
+  stream.write(temp);
+  snprintf(temp, sizeof(temp), "\t; loop-carried dependencies: %.2f cycles / iteration\n", carried);
+  stream.write(temp);
+  snprintf(temp, sizeof(temp), "\t; estimated: %.2f cycles / iteration\n",
+    std::max(throughput, carried));
+  stream.write(temp);
+
+  // Pressure on each unit:
+  stream.write("\t; resource pressure (cycles / iteration):\n");
+  for (unsigned i = 1; i != model.getNumProcResourceKinds(); ++i) {
+    llvm::MCProcResourceDesc const* resource = model.getProcResource(i);
+    if (resource->SubUnitsIdxBegin || pressure[i] == 0)
+      continue;
+    snprintf(temp, sizeof(temp), "\t;   %-24s %8.2f\n", resource->Name,
+      pressure[i] / resource->NumUnits);
+    stream.write(temp);
+  }
+
+  // Critical dependency chain of a single iteration:
+  std::string text;
+  int last = 0;
+  for (std::size_t i = 0; i != instructions.size(); ++i)
+    if (instructions[i].end > instructions[last].end)
+      last = i;
+  std::vector<int> chain;
+  for (int i = last; i >= 0; i = instructions[i].predecessor)
+    chain.push_back(i);
+  snprintf(temp, sizeof(temp), "\t; critical dependency chain: %u cycles\n",
+    instructions[last].end);
+  stream.write(temp);
+  for (auto i = chain.rbegin(); i != chain.rend(); ++i) {
+    Instruction const& instruction = instructions[*i];
+    // The x86 PC-relative operands are relative to the next instruction:
+    std::uint64_t next = instruction.address + instruction.size;
+    text.clear();
+    llvm::raw_string_ostream os(text);
+    impl.printer->printInst(&instruction.inst, next, "", *impl.sti, os);
+    os.flush();
+    std::replace(text.begin(), text.end(), '\t', ' ');
+    stream.write("\t;   ");
+    stream.hex(instruction.address, 16);
+    snprintf(temp, sizeof(temp), " [%3d] ", instruction.latency);
+    stream.write(temp);
+    stream.write(text.c_str() + std::min(text.find_first_not_of(' '), text.size()));
+    stream.put('\n');
+  }
+
+  // Each instruction:
+  stream.write("\t;    latency  rthroughput  uops\n");
+  for (Instruction const& instruction : instructions) {
+    std::uint64_t next = instruction.address + instruction.size;
+    text.clear();
+    llvm::raw_string_ostream os(text);
+    impl.printer->printInst(&instruction.inst, next, "", *impl.sti, os);
+    os.flush();
+    snprintf(temp, sizeof(temp), "%10d %12.2f %5u  ",
+      instruction.latency, instruction.throughput, instruction.micro_ops);
+    stream.write(temp);
+    stream.hex(instruction.address, 16);
+    stream.write(":\t", 2);
+    stream.write(text.c_str() + std::min(text.find_first_not_of('\t'), text.size()));
+    stream.put('\n');
+  }
+  stream.put('\n');
+}
+
+}
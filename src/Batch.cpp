@@ -0,0 +1,144 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cerrno>
+#include <cstring>
+
+#include <iostream>
+
+#include <unistd.h>
+
+#include "unjit.hpp"
+#include "parse.hpp"
+
+namespace unjit {
+
+// Parse "$start $stop" or "$start +$size":
+static bool parse_range(const char* p, const char* end, Symbol& symbol)
+{
+  std::uint64_t start, stop;
+  skip_spaces(p, end);
+  if (!parse_hex_prefixed(p, end, start) || !skip_spaces(p, end))
+    return false;
+  bool relative = skip(p, end, '+');
+  if (!parse_hex_prefixed(p, end, stop))
+    return false;
+  skip_spaces(p, end);
+  if (p != end)
+    return false;
+  if (relative)
+    stop += start;
+  if (stop <= start)
+    return false;
+  symbol.value = start;
+  symbol.size = stop - start;
+  return true;
+}
+
+static void disassemble_ranges(Output& stream, Process& process,
+  Disassembler& disassembler, BatchReader& reader, std::vector<Symbol>& symbols)
+{
+  // Use the name of the symbol starting at this address (if any):
+  for (Symbol& symbol : symbols) {
+    Symbol found;
+    std::uint64_t offset;
+    if (process.find_symbol(symbol.value, &found, &offset) && offset == 0) {
+      symbol.name = found.name;
+      symbol.name_size = found.name_size;
+    } else {
+      symbol.name = "_";
+      symbol.name_size = 1;
+    }
+  }
+
+  std::size_t i = 0;
+  while (i != symbols.size()) {
+    std::size_t j = reader.read(symbols, i, batch_size);
+    for (; i != j; ++i) {
+      Symbol const& symbol = symbols[i];
+      stream.write("#begin ");
+      stream.hex(symbol.value);
+      stream.put(' ');
+      stream.hex(symbol.value + symbol.size);
+      stream.put('\n');
+      // The parts which could not be read are skipped as without --batch:
+      Disassembler::Read read = disassembler.disassemble(stream, symbol, reader);
+      stream.write("#end ");
+      stream.hex(symbol.value);
+      stream.put(' ');
+      stream.hex(symbol.value + symbol.size);
+      stream.write(read == Disassembler::Read::all ? " ok\n" :
+        read == Disassembler::Read::partial ? " partial\n" : " error\n");
+    }
+  }
+  symbols.clear();
+}
+
+bool disassemble_batch(Output& stream, Process& process,
+  Disassembler& disassembler, int fd)
+{
+  BatchReader reader(process.pid(), &process.vmas(), process.image());
+  std::vector<char> buffer(64 << 10);
+  std::size_t size = 0;
+  std::size_t line = 0;
+  std::vector<Symbol> symbols;
+  while (1) {
+    if (size == buffer.size())
+      buffer.resize(2 * buffer.size());
+    ssize_t res = read(fd, buffer.data() + size, buffer.size() - size);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res < 0)
+      return false;
+    size += res;
+    // The last line may not have a newline:
+    if (res == 0 && size != 0 && buffer[size - 1] != '\n')
+      buffer[size++] = '\n';
+
+    // Parse the complete lines:
+    const char* p = buffer.data();
+    const char* end = p + size;
+    while (const char* eol = (const char*) std::memchr(p, '\n', end - p)) {
+      ++line;
+      Symbol symbol;
+      const char* q = p;
+      skip_spaces(q, eol);
+      if (q != eol && *q != '#') {
+        if (parse_range(q, eol, symbol))
+          symbols.push_back(symbol);
+        else
+          std::cerr << "Bad range on line " << line << '\n';
+      }
+      p = eol + 1;
+    }
+    size = end - p;
+    std::memmove(buffer.data(), p, size);
+
+    disassemble_ranges(stream, process, disassembler, reader, symbols);
+    stream.flush();
+    if (res == 0)
+      return true;
+  }
+}
+
+}
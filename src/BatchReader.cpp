@@ -0,0 +1,343 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <climits>
+#include <cstring>
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "unjit.hpp"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+namespace unjit {
+
+// Number of pages kept by the fallback reader:
+static const std::size_t page_cache_size = 64;
+
+static std::uint64_t page_size()
+{
+  static const std::uint64_t size = sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+void BatchReader::read(Range const* ranges, std::size_t count)
+{
+  // Sort the ranges and merge the adjacent/overlapping ones:
+  std::vector<Range> sorted(ranges, ranges + count);
+  std::sort(sorted.begin(), sorted.end(), [](Range const& a, Range const& b) {
+    return a.start < b.start;
+  });
+  extents_.clear();
+  holes_.clear();
+  pages_.clear();
+  next_page_ = 0;
+  std::size_t total = 0;
+  for (Range const& range : sorted) {
+    if (range.size == 0)
+      continue;
+    if (!extents_.empty()) {
+      Extent& last = extents_.back();
+      if (range.start <= last.start + last.size) {
+        std::uint64_t end = std::max(last.start + last.size, range.start + range.size);
+        total += end - (last.start + last.size);
+        last.size = end - last.start;
+        continue;
+      }
+    }
+    Extent extent;
+    extent.start = range.start;
+    extent.size = range.size;
+    extent.offset = total;
+    extent.read = false;
+    extent.complete = false;
+    extent.mapped = nullptr;
+    extents_.push_back(extent);
+    total += range.size;
+  }
+  if (image_) {
+    this->read_image();
+    return;
+  }
+  if (arena_.size() < total)
+    arena_.resize(total);
+
+  // Read up to IOV_MAX extents per syscall. On a partial read, the rest
+  // of the extent where the read stopped is recovered chunk by chunk and
+  // we continue with the next one.
+  std::vector<struct iovec> remote;
+  std::size_t n = extents_.size();
+  std::size_t i = 0;
+  while (i != n) {
+    std::size_t j = std::min(n, i + IOV_MAX);
+    remote.clear();
+    for (std::size_t k = i; k != j; ++k) {
+      struct iovec iov;
+      iov.iov_base = (void*) extents_[k].start;
+      iov.iov_len = extents_[k].size;
+      remote.push_back(iov);
+    }
+    struct iovec local;
+    local.iov_base = arena_.data() + extents_[i].offset;
+    local.iov_len = extents_[j - 1].offset + extents_[j - 1].size - extents_[i].offset;
+
+    ssize_t res = process_vm_readv(pid_, &local, 1, remote.data(), remote.size(), 0);
+    std::size_t done = res < 0 ? 0 : res;
+    count_stat(Counter::reads);
+    count_stat(Counter::read_bytes, done);
+    for (; i != j && extents_[i].size <= done; ++i) {
+      extents_[i].read = true;
+      extents_[i].complete = true;
+      done -= extents_[i].size;
+    }
+    if (i != j)
+      this->recover(extents_[i++], done);
+  }
+}
+
+void BatchReader::recover(Extent& extent, std::uint64_t done)
+{
+  std::size_t holes = holes_.size();
+  std::uint8_t* data = arena_.data() + extent.offset;
+  std::uint64_t address = extent.start + done;
+  std::uint64_t end = extent.start + extent.size;
+  while (address != end) {
+    std::uint64_t stop = end;
+
+    // Do not try to read outside of the VMAs:
+    if (vmas_ && !vmas_->empty()) {
+      auto i = std::upper_bound(vmas_->begin(), vmas_->end(), address,
+        [](std::uint64_t address, Vma const& vma) {
+          return address < vma.start;
+        });
+      if (i == vmas_->begin() || address >= (i - 1)->end) {
+        std::uint64_t next = i == vmas_->end() ? end : std::min(end, i->start);
+        this->add_hole(address, next - address);
+        std::memset(data + (address - extent.start), 0, next - address);
+        address = next;
+        continue;
+      }
+      stop = std::min(end, (i - 1)->end);
+    }
+
+    // Read as much as possible of this VMA:
+    struct iovec local, remote;
+    local.iov_base = data + (address - extent.start);
+    local.iov_len = stop - address;
+    remote.iov_base = (void*) address;
+    remote.iov_len = stop - address;
+    ssize_t res = process_vm_readv(pid_, &local, 1, &remote, 1, 0);
+    count_stat(Counter::reads);
+    if (res > 0) {
+      count_stat(Counter::read_bytes, res);
+      address += res;
+      continue;
+    }
+
+    // This page cannot be read with process_vm_readv():
+    std::uint64_t page_end = std::min(stop, (address / page_size() + 1) * page_size());
+    if (!this->read_page(address, data + (address - extent.start), page_end - address)) {
+      this->add_hole(address, page_end - address);
+      std::memset(data + (address - extent.start), 0, page_end - address);
+    }
+    address = page_end;
+  }
+  extent.read = true;
+  extent.complete = holes_.size() == holes;
+}
+
+void BatchReader::read_image()
+{
+  // The extents which are entirely in the image are used in place: only
+  // the other ones need the arena.
+  std::size_t total = 0;
+  for (Extent& extent : extents_) {
+    extent.mapped = image_->data(extent.start, extent.size);
+    extent.read = true;
+    extent.complete = extent.mapped != nullptr;
+    extent.offset = total;
+    if (!extent.mapped)
+      total += extent.size;
+  }
+  if (arena_.size() < total)
+    arena_.resize(total);
+
+  // Copy the available parts page by page:
+  for (Extent& extent : extents_) {
+    if (extent.mapped)
+      continue;
+    std::size_t holes = holes_.size();
+    std::uint8_t* data = arena_.data() + extent.offset;
+    std::uint64_t address = extent.start;
+    std::uint64_t end = extent.start + extent.size;
+    while (address != end) {
+      std::uint64_t page_end = std::min(end, (address / page_size() + 1) * page_size());
+      const std::uint8_t* page = image_->data(address, page_end - address);
+      if (page) {
+        std::memcpy(data + (address - extent.start), page, page_end - address);
+      } else {
+        this->add_hole(address, page_end - address);
+        std::memset(data + (address - extent.start), 0, page_end - address);
+      }
+      address = page_end;
+    }
+    extent.complete = holes_.size() == holes;
+  }
+}
+
+bool BatchReader::read_page(std::uint64_t address, std::uint8_t* data,
+  std::uint64_t size)
+{
+  std::uint64_t page = address - address % page_size();
+  for (Page const& entry : pages_)
+    if (entry.address == page) {
+      if (entry.valid)
+        std::memcpy(data, entry.data.data() + (address - page), size);
+      return entry.valid;
+    }
+
+  // /proc/$pid/mem can read some pages which process_vm_readv() cannot
+  // (such as the ones without PROT_READ):
+  if (!mem_opened_) {
+    mem_opened_ = true;
+    std::string filename = "/proc/" + std::to_string(pid_) + "/mem";
+    mem_ = FileDescriptor(open(filename.c_str(), O_RDONLY | O_CLOEXEC));
+  }
+  Page entry;
+  entry.address = page;
+  entry.data.resize(page_size());
+  entry.valid = mem_ >= 0
+    && pread(mem_, entry.data.data(), page_size(), page) == (ssize_t) page_size();
+  count_stat(Counter::reads);
+  if (entry.valid) {
+    count_stat(Counter::read_bytes, page_size());
+    std::memcpy(data, entry.data.data() + (address - page), size);
+  }
+  bool valid = entry.valid;
+
+  if (pages_.size() < page_cache_size)
+    pages_.push_back(std::move(entry));
+  else
+    pages_[next_page_++ % page_cache_size] = std::move(entry);
+  return valid;
+}
+
+void BatchReader::add_hole(std::uint64_t start, std::uint64_t size)
+{
+  count_stat(Counter::failed_reads);
+  if (!holes_.empty() && holes_.back().start + holes_.back().size == start) {
+    holes_.back().size += size;
+    return;
+  }
+  Range hole;
+  hole.start = start;
+  hole.size = size;
+  holes_.push_back(hole);
+}
+
+BatchReader::Extent const* BatchReader::find_extent(std::uint64_t start,
+  std::uint64_t size) const
+{
+  auto i = std::upper_bound(extents_.begin(), extents_.end(), start,
+    [](std::uint64_t start, Extent const& extent) {
+      return start < extent.start;
+    });
+  if (i == extents_.begin())
+    return nullptr;
+  --i;
+  if (!i->read || start + size > i->start + i->size)
+    return nullptr;
+  return &*i;
+}
+
+// The first hole ending after start:
+std::vector<Range>::const_iterator BatchReader::find_hole(std::uint64_t start) const
+{
+  return std::upper_bound(holes_.begin(), holes_.end(), start,
+    [](std::uint64_t start, Range const& hole) {
+      return start < hole.start + hole.size;
+    });
+}
+
+const std::uint8_t* BatchReader::data(std::uint64_t start, std::uint64_t size) const
+{
+  Extent const* extent = this->find_extent(start, size);
+  if (!extent)
+    return nullptr;
+  if (!extent->complete) {
+    auto i = this->find_hole(start);
+    if (i != holes_.end() && i->start < start + size)
+      return nullptr;
+  }
+  if (extent->mapped)
+    return extent->mapped + (start - extent->start);
+  return arena_.data() + extent->offset + (start - extent->start);
+}
+
+const std::uint8_t* BatchReader::partial_data(std::uint64_t start, std::uint64_t size,
+  std::vector<Range>& holes) const
+{
+  Extent const* extent = this->find_extent(start, size);
+  if (!extent)
+    return nullptr;
+  if (!extent->complete)
+    for (auto i = this->find_hole(start); i != holes_.end() && i->start < start + size; ++i) {
+      Range hole;
+      hole.start = std::max(i->start, start);
+      hole.size = std::min(i->start + i->size, start + size) - hole.start;
+      holes.push_back(hole);
+    }
+  if (extent->mapped)
+    return extent->mapped + (start - extent->start);
+  return arena_.data() + extent->offset + (start - extent->start);
+}
+
+std::size_t BatchReader::read(std::vector<Symbol> const& symbols,
+  std::size_t begin, std::uint64_t max_size)
+{
+  std::vector<Range> ranges;
+  std::uint64_t total = 0;
+  std::size_t i = begin;
+  for (; i != symbols.size(); ++i) {
+    Symbol const& symbol = symbols[i];
+    if (symbol.size == 0)
+      continue;
+    if (!ranges.empty() && total + symbol.size > max_size)
+      break;
+    Range range;
+    range.start = symbol.value;
+    range.size = symbol.size;
+    ranges.push_back(range);
+    total += symbol.size;
+  }
+  this->read(ranges.data(), ranges.size());
+  return i;
+}
+
+}
@@ -0,0 +1,71 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cstdint>
+#include <cstring>
+
+#include "unjit.hpp"
+
+namespace unjit {
+
+bool CodeDedup::add(Symbol const& symbol, const std::uint8_t* code, Symbol* first,
+  std::size_t* index)
+{
+  std::uint64_t hash = hash_bytes(code, symbol.size);
+  auto range = this->index_.equal_range(hash);
+  for (auto i = range.first; i != range.second; ++i) {
+    Entry const& entry = this->entries_[i->second];
+    if (entry.size != symbol.size
+        || std::memcmp(this->code_.data() + entry.code, code, symbol.size) != 0)
+      continue;
+    first->value = entry.value;
+    first->size = entry.size;
+    first->name = this->names_.data() + entry.name;
+    first->name_size = entry.name_size;
+    first->flags = 0;
+    if (index)
+      *index = i->second;
+    return true;
+  }
+
+  if (this->frozen_) {
+    if (index)
+      *index = SIZE_MAX;
+    return false;
+  }
+  Entry entry;
+  entry.value = symbol.value;
+  entry.size = symbol.size;
+  entry.code = this->code_.size();
+  entry.name = this->names_.size();
+  entry.name_size = symbol.name_size;
+  this->code_.insert(this->code_.end(), code, code + symbol.size);
+  this->names_.insert(this->names_.end(), symbol.name, symbol.name + symbol.name_size);
+  if (index)
+    *index = this->entries_.size();
+  this->index_.insert(std::make_pair(hash, this->entries_.size()));
+  this->entries_.push_back(entry);
+  return false;
+}
+
+}
@@ -0,0 +1,215 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cstring>
+
+#include <algorithm>
+
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/procfs.h>
+
+#include "unjit.hpp"
+
+namespace unjit {
+
+namespace {
+
+struct FileMapping {
+  std::uint64_t start, end, offset;
+  std::string name;
+};
+
+/* Parse a NT_FILE note
+
+   Layout: count, page size, count * (start, end, offset in pages) and the
+   count NUL-terminated file names.
+*/
+bool parse_file_note(const char* data, std::size_t size,
+  std::vector<FileMapping>& mappings)
+{
+  std::uint64_t header[2];
+  if (size < sizeof(header))
+    return false;
+  std::memcpy(header, data, sizeof(header));
+  std::uint64_t count = header[0], page_size = header[1];
+  if (count > (size - sizeof(header)) / 24)
+    return false;
+  const char* names = data + sizeof(header) + 24 * count;
+  const char* end = data + size;
+  for (std::uint64_t i = 0; i != count; ++i) {
+    std::uint64_t entry[3];
+    std::memcpy(entry, data + sizeof(header) + 24 * i, sizeof(entry));
+    const char* name_end = (const char*) std::memchr(names, '\0', end - names);
+    if (!name_end)
+      return false;
+    FileMapping mapping;
+    mapping.start = entry[0];
+    mapping.end = entry[1];
+    mapping.offset = entry[2] * page_size;
+    mapping.name.assign(names, name_end);
+    mappings.push_back(std::move(mapping));
+    names = name_end + 1;
+  }
+  return true;
+}
+
+}
+
+bool CoreFile::open(std::string const& filename)
+{
+  /* Only native (64-bit little-endian) cores are supported: this is what
+     the disassembler and the rest of unjit expect anyway. */
+
+  if (!core_.open(filename) || core_.size() < sizeof(Elf64_Ehdr))
+    return false;
+  const char* data = core_.data();
+  std::size_t size = core_.size();
+  Elf64_Ehdr ehdr;
+  std::memcpy(&ehdr, data, sizeof(ehdr));
+  if (std::memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0
+      || ehdr.e_ident[EI_CLASS] != ELFCLASS64
+      || ehdr.e_ident[EI_DATA] != ELFDATA2LSB
+      || ehdr.e_type != ET_CORE
+      || ehdr.e_phentsize != sizeof(Elf64_Phdr)
+      || ehdr.e_phoff > size
+      || ehdr.e_phnum > (size - ehdr.e_phoff) / sizeof(Elf64_Phdr))
+    return false;
+
+  std::vector<Elf64_Phdr> phdrs(ehdr.e_phnum);
+  std::memcpy(phdrs.data(), data + ehdr.e_phoff, ehdr.e_phnum * sizeof(Elf64_Phdr));
+
+  // Notes (process ID and file mappings):
+  std::vector<FileMapping> mappings;
+  for (Elf64_Phdr const& phdr : phdrs) {
+    if (phdr.p_type != PT_NOTE || phdr.p_offset > size
+        || phdr.p_filesz > size - phdr.p_offset)
+      continue;
+    const char* p = data + phdr.p_offset;
+    std::size_t remaining = phdr.p_filesz;
+    while (remaining >= sizeof(Elf64_Nhdr)) {
+      Elf64_Nhdr nhdr;
+      std::memcpy(&nhdr, p, sizeof(nhdr));
+      std::size_t name_size = (nhdr.n_namesz + 3) & ~3;
+      std::size_t desc_size = (nhdr.n_descsz + 3) & ~3;
+      if (remaining - sizeof(nhdr) < name_size
+          || remaining - sizeof(nhdr) - name_size < desc_size)
+        break;
+      const char* desc = p + sizeof(nhdr) + name_size;
+      if (nhdr.n_type == NT_PRSTATUS && nhdr.n_descsz >= sizeof(prstatus_t)
+          && pid_ < 0) {
+        prstatus_t status;
+        std::memcpy(&status, desc, sizeof(status));
+        pid_ = status.pr_pid;
+      } else if (nhdr.n_type == NT_FILE) {
+        parse_file_note(desc, nhdr.n_descsz, mappings);
+      }
+      p += sizeof(nhdr) + name_size + desc_size;
+      remaining -= sizeof(nhdr) + name_size + desc_size;
+    }
+  }
+
+  // The memory segments (one per VMA):
+  for (Elf64_Phdr const& phdr : phdrs) {
+    if (phdr.p_type != PT_LOAD || phdr.p_memsz == 0)
+      continue;
+    Vma vma;
+    vma.start = phdr.p_vaddr;
+    vma.end = phdr.p_vaddr + phdr.p_memsz;
+    vma.prot = (phdr.p_flags & PF_R ? PROT_READ : 0)
+      | (phdr.p_flags & PF_W ? PROT_WRITE : 0)
+      | (phdr.p_flags & PF_X ? PROT_EXEC : 0);
+    vma.flags = MAP_PRIVATE;
+    vma.offset = 0;
+
+    Segment segment;
+    segment.start = vma.start;
+    segment.end = vma.end;
+    segment.data = nullptr;
+    segment.size = 0;
+    if (phdr.p_offset <= size) {
+      segment.data = (const std::uint8_t*) data + phdr.p_offset;
+      segment.size = std::min<std::uint64_t>(
+        std::min(phdr.p_filesz, phdr.p_memsz), size - phdr.p_offset);
+    }
+    segment.file = nullptr;
+    segment.offset = 0;
+
+    auto mapping = std::find_if(mappings.begin(), mappings.end(),
+      [&vma](FileMapping const& mapping) {
+        return mapping.start <= vma.start && vma.start < mapping.end;
+      });
+    if (mapping != mappings.end()) {
+      vma.name = mapping->name;
+      vma.offset = mapping->offset + (vma.start - mapping->start);
+      segment.offset = vma.offset;
+      // The missing pages can be taken from the file:
+      if (segment.size < vma.end - vma.start) {
+        std::unique_ptr<MappedFile>& file = files_[vma.name];
+        if (!file) {
+          file.reset(new MappedFile());
+          if (!file->open(vma.name))
+            std::cerr << "Could not map " << vma.name << '\n';
+        }
+        if (file->data())
+          segment.file = file.get();
+      }
+    }
+    vmas_.push_back(std::move(vma));
+    segments_.push_back(segment);
+  }
+
+  auto by_start = [](Segment const& a, Segment const& b) {
+    return a.start < b.start;
+  };
+  std::sort(segments_.begin(), segments_.end(), by_start);
+  std::sort(vmas_.begin(), vmas_.end(), [](Vma const& a, Vma const& b) {
+    return a.start < b.start;
+  });
+  return !segments_.empty();
+}
+
+const std::uint8_t* CoreFile::data(std::uint64_t start, std::uint64_t size) const
+{
+  auto i = std::upper_bound(segments_.begin(), segments_.end(), start,
+    [](std::uint64_t start, Segment const& segment) {
+      return start < segment.start;
+    });
+  if (i == segments_.begin())
+    return nullptr;
+  Segment const& segment = *(i - 1);
+  if (start >= segment.end || size > segment.end - start)
+    return nullptr;
+  std::uint64_t offset = start - segment.start;
+
+  // In the core:
+  if (offset + size <= segment.size)
+    return segment.data + offset;
+  // In the mapped file:
+  if (offset >= segment.size && segment.file
+      && segment.offset + offset + size <= segment.file->size())
+    return (const std::uint8_t*) segment.file->data() + segment.offset + offset;
+  return nullptr;
+}
+
+}
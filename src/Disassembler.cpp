@@ -23,14 +23,17 @@ THE SOFTWARE.
 
 #include "unjit.hpp"
 
-#include <sys/uio.h>
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
 
 #include <stdexcept>
 #include <iostream>
-#include <iomanip>
 
 #include <llvm-c/Target.h>
 #include <llvm-c/Disassembler.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/TargetMachine.h>
 
 // This is an adapter for the API expected by LLVMDisasmContextRef:
 static const char* lookup_symbol(
@@ -40,21 +43,42 @@ static const char* lookup_symbol(
   uint64_t ReferencePC,
   const char **ReferenceName)
 {
-  unjit::Process *process = (unjit::Process *) DisInfo;
+  unjit::Disassembler *disassembler = (unjit::Disassembler *) DisInfo;
   *ReferenceType = 0;
   *ReferenceName = NULL;
-  return process->lookup_symbol(ReferenceValue);
+  return disassembler->lookup_symbol(ReferenceValue);
 }
 
 namespace unjit
 {
 
-Disassembler::Disassembler(Process& process) : process_(&process)
+void host_cpu(std::string& cpu, std::string& features)
 {
+  char* name = LLVMGetHostCPUName();
+  cpu = name;
+  LLVMDisposeMessage(name);
+  char* host_features = LLVMGetHostCPUFeatures();
+  features = host_features;
+  LLVMDisposeMessage(host_features);
+}
+
+Disassembler::Disassembler(Process& process, std::string const& cpu,
+    std::string const& features) :
+  process_(&process), cpu_(cpu), features_(features),
+  reader_(process.pid(), &process.vmas(), process.image())
+{
+  // The JIT-ed code usually targets the host CPU:
+  if (this->cpu_.empty()) {
+    std::string host_features;
+    host_cpu(this->cpu_, host_features);
+    if (this->features_.empty())
+      this->features_ = host_features;
+  }
+
   // Create and setup the disassembler:
-  this->disassembler_ = LLVMCreateDisasmCPU(
-    LLVM_HOST_TRIPLE, "core2",
-    this->process_, 0, NULL, lookup_symbol);
+  this->disassembler_ = LLVMCreateDisasmCPUFeatures(
+    LLVM_HOST_TRIPLE, this->cpu_.c_str(), this->features_.c_str(),
+    this, 0, NULL, ::lookup_symbol);
   if (!this->disassembler_) {
     throw std::runtime_error("Could not intialize LLVM disassembler");
   }
@@ -67,53 +91,215 @@ Disassembler::~Disassembler()
   LLVMDisasmDispose(this->disassembler_);
 }
 
-void Disassembler::disassemble_code(std::ostream& stream, uint8_t *code, std::uint64_t start, std::size_t size)
+const char* Disassembler::lookup_symbol(std::uint64_t address)
+{
+  Symbol symbol;
+  std::uint64_t offset;
+  if (!this->process_->find_symbol(address, &symbol, &offset))
+    return nullptr;
+  if (offset != 0) {
+    // LLVM would quote "name+0x48" as a symbol name: let LLVM print the
+    // address and add the symbol after the instruction instead.
+    char temp[32];
+    snprintf(temp, sizeof(temp), "+0x%" PRIx64 ">", offset);
+    this->target_comment_.assign(" <");
+    this->target_comment_.append(symbol.name, symbol.name_size);
+    this->target_comment_ += temp;
+    return nullptr;
+  }
+  this->symbol_buffer_.assign(symbol.name, symbol.name_size);
+  return this->symbol_buffer_.c_str();
+}
+
+void Disassembler::disassemble_code(Output& stream, const uint8_t *code, std::uint64_t start, std::size_t size)
 {
   std::uint64_t pc = start;
   char temp[256];
+  std::uint64_t instructions = 0;
   while (size) {
+    this->target_comment_.clear();
     size_t c = LLVMDisasmInstruction(this->disassembler_,
-      code, size, pc, temp, sizeof(temp));
-    if (c == 0)
-      return;
-    stream << std::setfill('0') << std::setw(16) << std::hex << pc
-      << ":\t" << temp << '\n';
+      const_cast<uint8_t*>(code), size, pc, temp, sizeof(temp));
+    if (c == 0) {
+      count_stat(Counter::undecodable);
+      if (this->samples_)
+        this->write_samples(stream, 0);
+      stream.hex(pc, 16);
+      // Same columns as the decoded instructions (LLVM starts them with a tab):
+      stream.write(":\t\t(bad)\n", 9);
+      // Resynchronize on the next byte (as objdump does):
+      --size;
+      ++code;
+      ++pc;
+      continue;
+    }
+    if (this->samples_)
+      this->write_samples(stream, this->samples_->count(pc, c));
+    stream.hex(pc, 16);
+    stream.write(":\t", 2);
+    this->write_instruction(stream, temp);
+    stream.put('\n');
     size -= c;
     code += c;
     pc += c;
+    ++instructions;
   }
+  count_stat(Counter::instructions, instructions);
 }
 
-void Disassembler::disassemble(std::ostream& stream, const char* name, std::uint64_t start, std::uint64_t size)
+void Disassembler::write_instruction(Output& stream, const char* text)
 {
-  if (this->buffer_.size() < size)
-    this->buffer_.resize(size);
-  if (size == 0)
+  std::size_t size = this->target_comment_.size();
+  if (size == 0) {
+    stream.write(text);
     return;
+  }
 
-  struct iovec local, remote;
+  // The target goes after the operands, before the comments of LLVM
+  // (latency), taking its place in the padding when possible:
+  const char* comment = std::strchr(text, '#');
+  const char* end = comment ? comment : text + std::strlen(text);
+  while (end != text && end[-1] == ' ')
+    --end;
+  stream.write(text, end - text);
+  stream.write(this->target_comment_.data(), size);
+  if (comment) {
+    std::size_t padding = comment - end;
+    padding = padding > size ? padding - size : 1;
+    for (std::size_t i = 0; i != padding; ++i)
+      stream.put(' ');
+    stream.write(comment);
+  }
+}
 
-  local.iov_base = this->buffer_.data();
-  local.iov_len = size;
+void Disassembler::write_samples(Output& stream, std::uint64_t count)
+{
+  char temp[32];
+  if (count == 0) {
+    stream.write("                   ", 19);
+    return;
+  }
+  snprintf(temp, sizeof(temp), "%10" PRIu64 " %6.2f%% ", count,
+    100.0 * count / this->symbol_samples_);
+  stream.write(temp);
+}
 
-  remote.iov_base = (void*) start;
-  remote.iov_len = size;
+Disassembler::Read Disassembler::disassemble(Output& stream,
+  Symbol const& symbol, BatchReader const& reader)
+{
+  const std::uint8_t* code = reader.data(symbol.value, symbol.size);
+  if (code) {
+    this->disassemble(stream, symbol, code);
+    return Read::all;
+  }
 
-  if (process_vm_readv(this->process_->pid(), &local, 1, &remote, 1, 0) == -1) {
+  // Disassemble the parts which could be read:
+  std::vector<Range> holes;
+  code = reader.partial_data(symbol.value, symbol.size, holes);
+  if (!code || (holes.size() == 1 && holes[0].size == symbol.size))
+    return Read::none;
+  this->write_header(stream, symbol);
+  if (this->analyzer_) {
+    // The analysis needs the whole code:
+    stream.write("\t; not analyzed: some of the code could not be read\n\n");
+    return Read::partial;
+  }
+  std::uint64_t address = symbol.value;
+  for (std::size_t i = 0; i <= holes.size(); ++i) {
+    std::uint64_t end = i == holes.size() ? symbol.value + symbol.size : holes[i].start;
+    this->disassemble_code(stream, code + (address - symbol.value), address, end - address);
+    if (i == holes.size())
+      break;
+    stream.write("\t; could not read ");
+    stream.hex(holes[i].start);
+    stream.put('-');
+    stream.hex(holes[i].start + holes[i].size);
+    stream.put('\n');
+    address = holes[i].start + holes[i].size;
+  }
+  stream.put('\n');
+  return Read::partial;
+}
+
+void Disassembler::disassemble_read(Output& stream, Symbol const& symbol)
+{
+  if (this->disassemble(stream, symbol, this->reader_) == Read::none) {
     // TODO, return/throw error
-    std::cerr << "Error, could not read the instructions for " << name << '\n';
+    std::cerr << "Error, could not read the instructions for " << symbol.name_string() << '\n';
+  }
+}
+
+void Disassembler::write_header(Output& stream, Symbol const& symbol)
+{
+  stream.hex(symbol.value);
+  stream.write(" <", 2);
+  stream.write(symbol.name, symbol.name_size);
+  stream.write(">\n", 2);
+  if (this->samples_) {
+    this->symbol_samples_ = this->samples_->count(symbol.value, symbol.size);
+    char temp[64];
+    std::uint64_t total = this->samples_->total();
+    snprintf(temp, sizeof(temp), "\t; samples: %" PRIu64 " (%.2f%%)\n",
+      this->symbol_samples_, total ? 100.0 * this->symbol_samples_ / total : 0.0);
+    stream.write(temp);
+  }
+}
+
+void Disassembler::disassemble(Output& stream, Symbol const& symbol, const std::uint8_t* code)
+{
+  if (this->analyzer_) {
+    this->analyzer_->analyze(stream, symbol, code);
     return;
   }
+  this->write_header(stream, symbol);
+  Symbol first;
+  if (this->dedup_ && this->dedup_->add(symbol, code, &first)
+      && first.value != symbol.value) {
+    stream.write("\t; same code as ");
+    stream.hex(first.value);
+    stream.write(" <", 2);
+    stream.write(first.name, first.name_size);
+    stream.write(">\n\n", 3);
+    return;
+  }
+  this->disassemble_code(stream, code, symbol.value, symbol.size);
+  stream.put('\n');
+}
+
+void Disassembler::disassemble(Output& stream, Symbol const& symbol)
+{
+  if (symbol.size == 0)
+    return;
+  Range range;
+  range.start = symbol.value;
+  range.size = symbol.size;
+  this->reader_.read(&range, 1);
+  this->disassemble_read(stream, symbol);
+}
 
-  stream << std::hex << start << " <" << name << ">\n";
-  this->disassemble_code(stream, this->buffer_.data(), start, size);
-  stream << '\n';
+void Disassembler::disassemble(Output& stream, std::uint64_t start, std::uint64_t size)
+{
+  Symbol symbol;
+  std::uint64_t offset;
+  if (!process_->find_symbol(start, &symbol, &offset) || offset != 0) {
+    symbol.name = "_";
+    symbol.name_size = 1;
+  }
+  symbol.value = start;
+  symbol.size = size;
+  disassemble(stream, symbol);
 }
 
-void Disassembler::disassemble(std::ostream& stream, std::uint64_t start, std::uint64_t size)
+void Disassembler::disassemble(Output& stream, std::vector<Symbol> const& symbols)
 {
-  const char* name = process_->lookup_symbol(start);
-  disassemble(stream, name ? name : "_" , start, size);
+  std::size_t n = symbols.size();
+  std::size_t i = 0;
+  while (i != n) {
+    std::size_t j = this->reader_.read(symbols, i, batch_size);
+    for (; i != j; ++i)
+      if (symbols[i].size != 0)
+        this->disassemble_read(stream, symbols[i]);
+  }
 }
 
 }
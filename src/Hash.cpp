@@ -0,0 +1,80 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cstring>
+
+#include "unjit.hpp"
+
+namespace unjit {
+
+static inline std::uint64_t rotl(std::uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline std::uint64_t mix(std::uint64_t x)
+{
+  // splitmix64 finalizer:
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+std::uint64_t hash_bytes(const void* data, std::size_t size)
+{
+  // Four independent lanes of 8 bytes so that the loop is not bound by
+  // the multiplication latency:
+  const std::uint64_t prime1 = 0x9e3779b185ebca87ULL;
+  const std::uint64_t prime2 = 0xc2b2ae3d27d4eb4fULL;
+  const unsigned char* p = (const unsigned char*) data;
+  const std::size_t length = size;
+  std::uint64_t h[4] = { prime1, prime2, ~prime1, ~prime2 };
+  while (size >= 32) {
+    for (int i = 0; i != 4; ++i) {
+      std::uint64_t k;
+      std::memcpy(&k, p + 8 * i, 8);
+      h[i] = rotl(h[i] + k * prime2, 31) * prime1;
+    }
+    p += 32;
+    size -= 32;
+  }
+  std::uint64_t res = rotl(h[0], 1) + rotl(h[1], 7) + rotl(h[2], 12) + rotl(h[3], 18);
+  while (size >= 8) {
+    std::uint64_t k;
+    std::memcpy(&k, p, 8);
+    res = rotl(res ^ (k * prime2), 27) * prime1;
+    p += 8;
+    size -= 8;
+  }
+  if (size) {
+    std::uint64_t k = 0;
+    std::memcpy(&k, p, size);
+    res = rotl(res ^ (k * prime2), 27) * prime1;
+  }
+  return mix(res ^ length);
+}
+
+}
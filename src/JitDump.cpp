@@ -0,0 +1,155 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cstring>
+
+#include <algorithm>
+#include <unordered_map>
+
+#include "unjit.hpp"
+
+namespace unjit {
+
+namespace {
+
+const std::uint32_t jitdump_magic = 0x4A695444; // "JiTD"
+
+enum {
+  JIT_CODE_LOAD = 0,
+  JIT_CODE_MOVE = 1,
+  JIT_CODE_DEBUG_INFO = 2,
+  JIT_CODE_CLOSE = 3,
+  JIT_CODE_UNWINDING_INFO = 4,
+};
+
+struct JitDumpHeader {
+  std::uint32_t magic;
+  std::uint32_t version;
+  std::uint32_t total_size;
+  std::uint32_t elf_mach;
+  std::uint32_t pad1;
+  std::uint32_t pid;
+  std::uint64_t timestamp;
+  std::uint64_t flags;
+};
+
+struct JitDumpRecordHeader {
+  std::uint32_t id;
+  std::uint32_t total_size;
+  std::uint64_t timestamp;
+};
+
+struct JitCodeLoad {
+  std::uint32_t pid;
+  std::uint32_t tid;
+  std::uint64_t vma;
+  std::uint64_t code_addr;
+  std::uint64_t code_size;
+  std::uint64_t code_index;
+  // Followed by the NUL-terminated name and the code.
+};
+
+struct JitCodeMove {
+  std::uint32_t pid;
+  std::uint32_t tid;
+  std::uint64_t vma;
+  std::uint64_t old_code_addr;
+  std::uint64_t new_code_addr;
+  std::uint64_t code_size;
+  std::uint64_t code_index;
+};
+
+}
+
+bool JitDump::open(std::string const& filename)
+{
+  entries_.clear();
+  if (!file_.open(filename) || file_.size() < sizeof(JitDumpHeader))
+    return false;
+
+  const char* data = file_.data();
+  std::size_t size = file_.size();
+  JitDumpHeader header;
+  std::memcpy(&header, data, sizeof(header));
+  // We do not handle dumps with a different endianness:
+  if (header.magic != jitdump_magic || header.total_size < sizeof(header)
+      || header.total_size > size)
+    return false;
+  pid_ = header.pid;
+
+  // Last load of each code index (for the code moves):
+  std::unordered_map<std::uint64_t, std::size_t> loads;
+
+  // Stop at the first truncated record: the JIT might still be writing it.
+  std::size_t offset = header.total_size;
+  while (size - offset >= sizeof(JitDumpRecordHeader)) {
+    JitDumpRecordHeader record;
+    std::memcpy(&record, data + offset, sizeof(record));
+    if (record.total_size < sizeof(record) || record.total_size > size - offset)
+      break;
+    const char* body = data + offset + sizeof(record);
+    std::size_t body_size = record.total_size - sizeof(record);
+
+    if (record.id == JIT_CODE_LOAD && body_size >= sizeof(JitCodeLoad)) {
+      JitCodeLoad load;
+      std::memcpy(&load, body, sizeof(load));
+      const char* name = body + sizeof(load);
+      const char* end = body + body_size;
+      const char* name_end = (const char*) std::memchr(name, '\0', end - name);
+      if (name_end && (std::uint64_t) (end - name_end - 1) >= load.code_size) {
+        Entry entry;
+        entry.timestamp = record.timestamp;
+        entry.address = load.code_addr;
+        entry.size = load.code_size;
+        entry.name = name;
+        entry.name_size = name_end - name;
+        entry.code = (const std::uint8_t*) name_end + 1;
+        loads[load.code_index] = entries_.size();
+        entries_.push_back(entry);
+      }
+    } else if (record.id == JIT_CODE_MOVE && body_size >= sizeof(JitCodeMove)) {
+      JitCodeMove move;
+      std::memcpy(&move, body, sizeof(move));
+      auto i = loads.find(move.code_index);
+      if (i != loads.end()) {
+        Entry entry = entries_[i->second];
+        entry.timestamp = record.timestamp;
+        entry.address = move.new_code_addr;
+        entry.size = std::min(entry.size, move.code_size);
+        i->second = entries_.size();
+        entries_.push_back(entry);
+      }
+    } else if (record.id == JIT_CODE_CLOSE) {
+      break;
+    }
+
+    offset += record.total_size;
+  }
+
+  // The records of several threads may not be written in timestamp order:
+  std::stable_sort(entries_.begin(), entries_.end(),
+    [](Entry const& a, Entry const& b) { return a.timestamp < b.timestamp; });
+  return true;
+}
+
+}
@@ -0,0 +1,208 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <climits>
+#include <cstring>
+
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "unjit.hpp"
+
+namespace unjit {
+
+// Layout of the dynamic linker structures (in a 64-bit process):
+struct RemoteDebug {
+  std::int32_t r_version;
+  std::uint64_t r_map;
+  std::uint64_t r_brk;
+  std::int32_t r_state;
+  std::uint64_t r_ldbase;
+};
+
+struct RemoteLinkMap {
+  std::uint64_t l_addr;
+  std::uint64_t l_name;
+  std::uint64_t l_ld;
+  std::uint64_t l_next;
+  std::uint64_t l_prev;
+};
+
+// Protection against corrupted lists:
+static const std::size_t max_link_map_entries = 1 << 16;
+
+static bool read_remote(pid_t pid, std::uint64_t address, void* data, std::size_t size)
+{
+  struct iovec local, remote;
+  local.iov_base = data;
+  local.iov_len = size;
+  remote.iov_base = (void*) address;
+  remote.iov_len = size;
+  return process_vm_readv(pid, &local, 1, &remote, 1, 0) == (ssize_t) size;
+}
+
+static bool read_remote_string(pid_t pid, std::uint64_t address, std::string& res)
+{
+  res.clear();
+  char buffer[256];
+  while (res.size() < PATH_MAX) {
+    // Do not read across a page boundary (the next page may be unmapped):
+    std::size_t size = sizeof(buffer) - address % sizeof(buffer);
+    if (!read_remote(pid, address, buffer, size))
+      return false;
+    const char* end = (const char*) std::memchr(buffer, '\0', size);
+    res.append(buffer, end ? end - buffer : size);
+    if (end)
+      return true;
+    address += size;
+  }
+  return false;
+}
+
+/* Read the ELF header of the executable of a process
+
+   Returns its ELF class (ELFCLASSNONE if it could not be read). The
+   header is only filled for ELFCLASS64.
+*/
+static int read_executable_header(pid_t pid, Elf64_Ehdr& header)
+{
+  std::string filename = "/proc/" + std::to_string(pid) + "/exe";
+  FileDescriptor fd(open(filename.c_str(), O_RDONLY | O_CLOEXEC));
+  unsigned char ident[EI_NIDENT];
+  if (fd < 0 || pread(fd, ident, EI_NIDENT, 0) != EI_NIDENT
+      || std::memcmp(ident, ELFMAG, SELFMAG) != 0)
+    return ELFCLASSNONE;
+  if (ident[EI_CLASS] == ELFCLASS64
+      && pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header))
+    return ELFCLASSNONE;
+  return ident[EI_CLASS];
+}
+
+// Find the r_debug structure from the program headers of the executable:
+static std::uint64_t find_debug(pid_t pid)
+{
+  // The layout of the structures read here is only known for 64-bit
+  // processes (the auxiliary vector of a 32-bit one has 32-bit entries).
+  // Without the executable, the class is checked with AT_PHENT:
+  Elf64_Ehdr header;
+  int elf_class = read_executable_header(pid, header);
+  if (elf_class != ELFCLASS64 && elf_class != ELFCLASSNONE)
+    return 0;
+
+  std::string filename = "/proc/" + std::to_string(pid) + "/auxv";
+  FileDescriptor fd(open(filename.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd < 0)
+    return 0;
+  std::uint64_t phdr = 0, phnum = 0, phent = 0;
+  Elf64_auxv_t auxv;
+  while (read(fd, &auxv, sizeof(auxv)) == sizeof(auxv) && auxv.a_type != AT_NULL) {
+    if (auxv.a_type == AT_PHDR)
+      phdr = auxv.a_un.a_val;
+    else if (auxv.a_type == AT_PHNUM)
+      phnum = auxv.a_un.a_val;
+    else if (auxv.a_type == AT_PHENT)
+      phent = auxv.a_un.a_val;
+  }
+  if (phdr == 0 || phnum == 0 || phnum > 1024 || phent != sizeof(Elf64_Phdr))
+    return 0;
+
+  std::vector<Elf64_Phdr> phdrs(phnum);
+  if (!read_remote(pid, phdr, phdrs.data(), phnum * sizeof(Elf64_Phdr)))
+    return 0;
+  // The bias of the executable is given by PT_PHDR:
+  std::uint64_t bias = 0, dynamic = 0, dynamic_size = 0;
+  bool found_phdr = false;
+  for (Elf64_Phdr const& ph : phdrs)
+    if (ph.p_type == PT_PHDR) {
+      bias = phdr - ph.p_vaddr;
+      found_phdr = true;
+    }
+  // Otherwise, the program headers are in the first PT_LOAD segment
+  // (at e_phoff in the file):
+  if (!found_phdr) {
+    std::uint64_t phoff = elf_class == ELFCLASS64 ? header.e_phoff : sizeof(Elf64_Ehdr);
+    for (Elf64_Phdr const& ph : phdrs)
+      if (ph.p_type == PT_LOAD) {
+        if (phoff < ph.p_offset || phoff - ph.p_offset >= ph.p_filesz)
+          return 0;
+        bias = phdr - (ph.p_vaddr + (phoff - ph.p_offset));
+        found_phdr = true;
+        break;
+      }
+  }
+  if (!found_phdr)
+    return 0;
+  for (Elf64_Phdr const& ph : phdrs)
+    if (ph.p_type == PT_DYNAMIC) {
+      dynamic = bias + ph.p_vaddr;
+      dynamic_size = ph.p_memsz;
+    }
+  if (dynamic == 0)
+    return 0;
+
+  std::vector<Elf64_Dyn> dyns(dynamic_size / sizeof(Elf64_Dyn));
+  if (dyns.empty()
+      || !read_remote(pid, dynamic, dyns.data(), dyns.size() * sizeof(Elf64_Dyn)))
+    return 0;
+  for (Elf64_Dyn const& dyn : dyns) {
+    if (dyn.d_tag == DT_NULL)
+      break;
+    if (dyn.d_tag == DT_DEBUG)
+      return dyn.d_un.d_ptr;
+  }
+  return 0;
+}
+
+bool read_link_map(pid_t pid, std::vector<LinkMapEntry>& entries)
+{
+  std::uint64_t debug_address = find_debug(pid);
+  if (debug_address == 0)
+    return false;
+  RemoteDebug debug;
+  if (!read_remote(pid, debug_address, &debug, sizeof(debug)) || debug.r_map == 0)
+    return false;
+
+  std::vector<LinkMapEntry> res;
+  std::uint64_t address = debug.r_map;
+  while (address != 0) {
+    if (res.size() == max_link_map_entries)
+      return false;
+    RemoteLinkMap link_map;
+    if (!read_remote(pid, address, &link_map, sizeof(link_map)))
+      return false;
+    LinkMapEntry entry;
+    entry.bias = link_map.l_addr;
+    entry.dynamic = link_map.l_ld;
+    if (link_map.l_name && !read_remote_string(pid, link_map.l_name, entry.name))
+      return false;
+    res.push_back(std::move(entry));
+    address = link_map.l_next;
+  }
+
+  entries = std::move(res);
+  return true;
+}
+
+}
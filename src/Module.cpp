@@ -21,10 +21,16 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+#include <cstring>
+
 #include <memory>
+#include <mutex>
+#include <sstream>
+#include <iomanip>
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 
 #include <libelf.h>
 
@@ -62,27 +68,134 @@ static Elf_Scn *elf_scn_symbol(Elf *elf)
     return elf_scn(elf, SHT_DYNSYM);
 }
 
-static Elf64_Half elf_e_type(Elf *elf)
+/* Find the GNU build-id (in hexadecimal) in a list of ELF notes
+
+   The names and descriptors are padded to the alignment of the notes.
+*/
+static std::string note_build_id(const char* p, std::size_t size, std::size_t align)
 {
-  Elf32_Ehdr* ehdr32 = elf32_getehdr(elf);
-  Elf64_Ehdr* ehdr64 = elf64_getehdr(elf);
-  if (ehdr32)
-    return ehdr32->e_type;
-  else if (ehdr64)
-    return ehdr64->e_type;
-  else
-    return ET_NONE;
+  // Elf32_Nhdr and Elf64_Nhdr have the same layout:
+  while (size >= sizeof(Elf64_Nhdr)) {
+    Elf64_Nhdr nhdr;
+    std::memcpy(&nhdr, p, sizeof(nhdr));
+    std::size_t name_size = ((std::size_t) nhdr.n_namesz + align - 1) & ~(align - 1);
+    std::size_t desc_size = ((std::size_t) nhdr.n_descsz + align - 1) & ~(align - 1);
+    if (size - sizeof(nhdr) < name_size
+        || size - sizeof(nhdr) - name_size < desc_size)
+      break;
+    const char* name = p + sizeof(nhdr);
+    const unsigned char* desc = (const unsigned char*) name + name_size;
+    if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == 4
+        && std::memcmp(name, "GNU", 4) == 0 && nhdr.n_descsz) {
+      std::ostringstream res;
+      res << std::hex << std::setfill('0');
+      for (Elf64_Word i = 0; i != nhdr.n_descsz; ++i)
+        res << std::setw(2) << (unsigned) desc[i];
+      return res.str();
+    }
+    p += sizeof(nhdr) + name_size + desc_size;
+    size -= sizeof(nhdr) + name_size + desc_size;
+  }
+  return std::string();
 }
 
-Module load_module(std::uint64_t start, std::string const& name)
+/* Read the type and the GNU build-id of an ELF file
+
+   This only reads the ELF header, the program headers and the PT_NOTE
+   segments (with pread) so that a cached module does not need libelf
+   at all. Only the native byte order is supported (the modules are
+   mapped by the target process).
+*/
+static bool read_elf_info(int fd, Elf64_Half* type, std::string* build_id)
 {
-  Module module;
+  union {
+    Elf32_Ehdr ehdr32;
+    Elf64_Ehdr ehdr64;
+  } header;
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header))
+    return false;
+  const unsigned char* ident = header.ehdr64.e_ident;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  if (ident[EI_DATA] != ELFDATA2LSB)
+    return false;
+#else
+  if (ident[EI_DATA] != ELFDATA2MSB)
+    return false;
+#endif
+  bool is64 = ident[EI_CLASS] == ELFCLASS64;
+  if (!is64 && ident[EI_CLASS] != ELFCLASS32)
+    return false;
+  *type = is64 ? header.ehdr64.e_type : header.ehdr32.e_type;
+  std::uint64_t phoff = is64 ? header.ehdr64.e_phoff : header.ehdr32.e_phoff;
+  std::size_t phentsize = is64 ? header.ehdr64.e_phentsize : header.ehdr32.e_phentsize;
+  std::size_t phnum = is64 ? header.ehdr64.e_phnum : header.ehdr32.e_phnum;
+  if (phentsize < (is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr))
+      || phentsize > 256)
+    return true;
 
-  // Init libelf:
-  if (elf_version(EV_CURRENT) == EV_NONE) {
-    std::cerr << "Elf version error\n";
-    return std::move(module);
+  std::vector<char> phdrs(phentsize * phnum);
+  if (pread(fd, phdrs.data(), phdrs.size(), phoff) != (ssize_t) phdrs.size())
+    return true;
+  std::vector<char> notes;
+  for (std::size_t i = 0; i != phnum; ++i) {
+    Elf64_Phdr phdr;
+    if (is64) {
+      std::memcpy(&phdr, phdrs.data() + i * phentsize, sizeof(phdr));
+    } else {
+      Elf32_Phdr phdr32;
+      std::memcpy(&phdr32, phdrs.data() + i * phentsize, sizeof(phdr32));
+      phdr.p_type = phdr32.p_type;
+      phdr.p_offset = phdr32.p_offset;
+      phdr.p_filesz = phdr32.p_filesz;
+      phdr.p_align = phdr32.p_align;
+    }
+    // The build-id note is small: do not read huge segments.
+    if (phdr.p_type != PT_NOTE || phdr.p_filesz > 0x10000)
+      continue;
+    notes.resize(phdr.p_filesz);
+    if (pread(fd, notes.data(), notes.size(), phdr.p_offset) != (ssize_t) notes.size())
+      continue;
+    *build_id = note_build_id(notes.data(), notes.size(), phdr.p_align == 8 ? 8 : 4);
+    if (!build_id->empty())
+      break;
+  }
+  return true;
+}
+
+/* Name of the symbol cache file of a module
+
+   The build-id is used when available. Otherwise we use the path and inode
+   of the file. The size and modification time of the file are part of the
+   name as well: a stripped binary and its unstripped copy have the same
+   build-id but not the same symbols.
+*/
+static std::string symbol_cache_file(std::string const& build_id, int fd,
+  std::string const& name)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    return std::string();
+  std::ostringstream res;
+  res << std::hex;
+  if (!build_id.empty())
+    res << build_id;
+  else {
+    // FNV-1a hash of the path:
+    std::uint64_t hash = 0xcbf29ce484222325ULL;
+    for (char c : name) {
+      hash ^= (unsigned char) c;
+      hash *= 0x100000001b3ULL;
+    }
+    res << "path-" << hash << '-' << st.st_ino;
   }
+  res << '-' << st.st_size << '-' << st.st_mtime << ".sym";
+  return res.str();
+}
+
+Module load_module(std::uint64_t start, std::string const& name,
+  std::string const& symbol_cache)
+{
+  Module module;
 
   // Open the file:
   FileDescriptor fd(open(name.c_str(), O_RDONLY));
@@ -90,15 +203,18 @@ Module load_module(std::uint64_t start, std::string const& name)
     std::cerr << "Could not open file " << name << "\n";
     return std::move(module);
   }
-  std::unique_ptr<Elf, elf_deleter> elf(elf_begin(fd, ELF_C_READ, nullptr));
-  if (!elf)
+
+  // Do not let libelf read (possibly huge) mapped data files:
+  unsigned char magic[SELFMAG];
+  if (pread(fd, magic, SELFMAG, 0) != SELFMAG
+      || std::memcmp(magic, ELFMAG, SELFMAG) != 0)
     return std::move(module);
 
   // Check if it is a suitable ELF file:
-  if (elf_kind(elf.get()) != ELF_K_ELF)
+  Elf64_Half e_type;
+  std::string build_id;
+  if (!read_elf_info(fd, &e_type, &build_id))
     return std::move(module);
-
-  Elf64_Half e_type = elf_e_type(elf.get());
   std::uint64_t offset;
   switch(e_type) {
   case ET_EXEC:
@@ -110,6 +226,41 @@ Module load_module(std::uint64_t start, std::string const& name)
   default:
     return std::move(module);
   }
+  module.bias = offset;
+  module.relocatable = e_type == ET_DYN;
+
+  // Use the cached symbols when available (before opening the file with
+  // libelf):
+  std::shared_ptr<SymbolIndex> symbols = std::make_shared<SymbolIndex>();
+  std::string cache_file;
+  if (!symbol_cache.empty()) {
+    cache_file = symbol_cache_file(build_id, fd, name);
+    if (!cache_file.empty()) {
+      cache_file = symbol_cache + "/" + cache_file;
+      if (symbols->load(cache_file)) {
+        module.name = name;
+        module.symbols = std::move(symbols);
+        return std::move(module);
+      }
+    }
+  }
+
+  // Init libelf (only once: the modules can be loaded concurrently):
+  static std::once_flag elf_init;
+  static unsigned elf_init_version = EV_NONE;
+  std::call_once(elf_init, []() {
+    elf_init_version = elf_version(EV_CURRENT);
+  });
+  if (elf_init_version == EV_NONE) {
+    std::cerr << "Elf version error\n";
+    return std::move(module);
+  }
+
+  // The section data is used in place in the mapped file (instead of being
+  // read in heap buffers by libelf): only the names are copied.
+  std::unique_ptr<Elf, elf_deleter> elf(elf_begin(fd, ELF_C_READ_MMAP, nullptr));
+  if (!elf || elf_kind(elf.get()) != ELF_K_ELF)
+    return std::move(module);
 
   // Find SHT_SYMTAB ot SHT_DYNSYM (symbol table):
   Elf_Scn *symbol_scn = elf_scn_symbol(elf.get());
@@ -151,16 +302,84 @@ Module load_module(std::uint64_t start, std::string const& name)
       continue;
 
     Symbol symbol;
-    symbol.value = st_value + offset;
+    symbol.value = st_value;
     symbol.size = st_size;
-    symbol.name = std::string(symbol_name);
+    symbol.name = symbol_name;
+    symbol.name_size = std::strlen(symbol_name);
     if (st_type == STT_FUNC)
       symbol.flags |= SYMBOL_FLAG_CODE;
 
-    module.symbols[symbol.value] = std::move(symbol);
+    if (!symbols->add(symbol)) {
+      // Do not cache the truncated symbols:
+      std::cerr << "Too many symbol names in " << name << ", ignoring the others\n";
+      cache_file.clear();
+      break;
+    }
   }
+  symbols->build();
+  count_stat(Counter::symbol_bytes, symbols->memory());
+
+  if (!cache_file.empty()) {
+    mkdir(symbol_cache.c_str(), 0777);
+    if (!symbols->save(cache_file))
+      std::cerr << "Could not write symbol cache file " << cache_file << "\n";
+  }
+  module.symbols = std::move(symbols);
 
   return std::move(module);
 }
 
+bool ModuleCache::Key::operator<(Key const& that) const
+{
+  if (device != that.device)
+    return device < that.device;
+  if (inode != that.inode)
+    return inode < that.inode;
+  if (size != that.size)
+    return size < that.size;
+  return mtime < that.mtime;
+}
+
+Module ModuleCache::load(std::uint64_t start, std::string const& name)
+{
+  struct stat st;
+  if (stat(name.c_str(), &st) != 0)
+    return load_module(start, name, symbol_cache_);
+  Key key;
+  key.device = st.st_dev;
+  key.inode = st.st_ino;
+  key.size = st.st_size;
+  key.mtime = st.st_mtime;
+
+  std::shared_ptr<Entry> entry;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::shared_ptr<Entry>& slot = entries_[key];
+    if (!slot)
+      slot = std::make_shared<Entry>();
+    else
+      count_stat(Counter::modules_shared);
+    entry = slot;
+  }
+  // Parsed without the lock (other modules can be loaded meanwhile):
+  std::call_once(entry->loaded, [&]() {
+    entry->module = load_module(0, name, symbol_cache_);
+  });
+
+  Module module;
+  if (entry->module.name.empty())
+    return std::move(module);
+  module.name = name;
+  module.relocatable = entry->module.relocatable;
+  module.bias = module.relocatable ? start : 0;
+  module.symbols = entry->module.symbols;
+  return std::move(module);
+}
+
+std::size_t ModuleCache::size() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
 }
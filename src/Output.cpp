@@ -0,0 +1,100 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cerrno>
+
+#include <algorithm>
+
+#include <unistd.h>
+
+#include "unjit.hpp"
+
+namespace unjit {
+
+static const char hex_digits[] = "0123456789abcdef";
+
+Output::Output(int fd, std::size_t capacity) :
+  fd_(fd), buffer_(capacity), size_(0), error_(false)
+{
+}
+
+Output::~Output()
+{
+  this->flush();
+}
+
+void Output::reserve(std::size_t size)
+{
+  if (fd_ >= 0)
+    this->flush();
+  if (buffer_.size() - size_ < size)
+    buffer_.resize(std::max(2 * buffer_.size(), size_ + size));
+}
+
+void Output::hex(std::uint64_t value, unsigned width)
+{
+  char temp[16];
+  unsigned n = 0;
+  do {
+    temp[15 - n++] = hex_digits[value & 0xf];
+    value >>= 4;
+  } while (value);
+  while (n < width && n < 16)
+    temp[15 - n++] = '0';
+  this->write(temp + 16 - n, n);
+}
+
+void Output::dec(std::uint64_t value)
+{
+  char temp[20];
+  unsigned n = 0;
+  do {
+    temp[19 - n++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  this->write(temp + 20 - n, n);
+}
+
+bool Output::flush()
+{
+  if (fd_ < 0)
+    return true;
+  const char* data = buffer_.data();
+  std::size_t size = size_;
+  while (size) {
+    ssize_t res = ::write(fd_, data, size);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0) {
+      error_ = true;
+      break;
+    }
+    data += res;
+    size -= res;
+    count_stat(Counter::output_bytes, res);
+  }
+  size_ = 0;
+  return !error_;
+}
+
+}
@@ -0,0 +1,167 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cstdint>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "unjit.hpp"
+
+namespace unjit {
+
+// Target size (in bytes of code) of a work item:
+static const std::uint64_t item_size = 256 << 10;
+
+namespace {
+
+struct WorkItem {
+  std::size_t begin, end; // in the symbol list
+  std::unique_ptr<Output> output;
+  bool done = false;
+};
+
+}
+
+void disassemble_parallel(Output& stream, Disassembler const& model,
+  std::vector<Symbol> const& symbols, unsigned jobs, bool dedup)
+{
+  Process& process = model.process();
+
+  // Register the first copy of each blob before starting the workers. The
+  // table keeps a copy of each distinct blob: the workers disassemble from
+  // these copies instead of reading the code again.
+  CodeDedup table;
+  std::vector<const std::uint8_t*> codes;
+  if (dedup) {
+    BatchReader reader(process.pid(), &process.vmas(), process.image());
+    std::vector<std::size_t> entries(symbols.size(), SIZE_MAX);
+    Symbol first;
+    std::size_t i = 0;
+    while (i != symbols.size()) {
+      std::size_t j = reader.read(symbols, i, batch_size);
+      for (; i != j; ++i) {
+        const std::uint8_t* code = symbols[i].size ?
+          reader.data(symbols[i].value, symbols[i].size) : nullptr;
+        if (code)
+          table.add(symbols[i], code, &first, &entries[i]);
+      }
+    }
+    table.freeze();
+    // The symbols which could not be read (entirely) are read by the workers:
+    codes.resize(symbols.size());
+    for (std::size_t i = 0; i != symbols.size(); ++i)
+      codes[i] = entries[i] == SIZE_MAX ? nullptr : table.code(entries[i]);
+  }
+
+  // Split the symbols in work items:
+  std::vector<WorkItem> items;
+  std::size_t n = symbols.size();
+  for (std::size_t i = 0; i != n;) {
+    WorkItem item;
+    item.begin = i;
+    std::uint64_t total = 0;
+    while (i != n && (i == item.begin || total + symbols[i].size <= item_size))
+      total += symbols[i++].size;
+    item.end = i;
+    items.push_back(std::move(item));
+  }
+
+  // The workers can only run this far ahead of the writer. This bounds
+  // the memory used by the buffered output.
+  const std::size_t window = 8 * jobs;
+
+  std::mutex mutex;
+  std::condition_variable item_done, item_written;
+  std::size_t next = 0, written = 0;
+
+  auto worker = [&]() {
+    Disassembler disassembler(process, model.cpu(), model.features());
+    if (dedup)
+      disassembler.set_dedup(&table);
+    disassembler.set_samples(model.samples());
+    std::vector<Symbol> slice;
+    while (1) {
+      std::size_t i;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        item_written.wait(lock, [&]() {
+          return next == items.size() || next < written + window;
+        });
+        if (next == items.size())
+          return;
+        i = next++;
+      }
+
+      WorkItem& item = items[i];
+      std::unique_ptr<Output> output(new Output(-1, 64 << 10));
+      if (dedup) {
+        for (std::size_t j = item.begin; j != item.end; ++j) {
+          if (symbols[j].size == 0)
+            continue;
+          if (codes[j])
+            disassembler.disassemble(*output, symbols[j], codes[j]);
+          else
+            disassembler.disassemble(*output, symbols[j]);
+        }
+      } else {
+        slice.assign(symbols.begin() + item.begin, symbols.begin() + item.end);
+        disassembler.disassemble(*output, slice);
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        item.output = std::move(output);
+        item.done = true;
+      }
+      item_done.notify_all();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i != jobs; ++i)
+    threads.push_back(std::thread(worker));
+
+  // Write the output in order:
+  while (written != items.size()) {
+    std::unique_ptr<Output> output;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      item_done.wait(lock, [&]() { return items[written].done; });
+      output = std::move(items[written].output);
+    }
+    stream.write(output->data(), output->size());
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++written;
+    }
+    item_written.notify_all();
+  }
+
+  for (std::thread& thread : threads)
+    thread.join();
+}
+
+}
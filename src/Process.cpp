@@ -21,16 +21,22 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+#include <cstdlib>
 #include <cstring>
+#include <cerrno>
+#include <cstdint>
 
+#include <algorithm>
 #include <string>
-#include <fstream>
+#include <thread>
 #include <iostream>
-#include <regex>
 
 #include <sys/mman.h>
+#include <dirent.h>
+#include <fcntl.h>
 
 #include "unjit.hpp"
+#include "parse.hpp"
 
 namespace unjit {
 
@@ -56,56 +62,49 @@ void Process::load_vm_maps()
   vmas_.clear();
   std::string filename =
     std::string("/proc/") + std::to_string(this->pid_) + std::string("/maps");
-  std::regex map_regex(
-    // Start-end:
-    "^([0-9a-f]+)-([0-9a-f]+)"
-    // Flags:
-    " ([r-])([w-])([x-])([p-])"
-    // Offset:
-    " ([0-9a-f]+)"
-    // Device (major/minor):
-    " [0-9a-f]+:[0-9a-f]+"
-    // icode:
-    " [0-9]*"
-    // File name:
-    " *(.*)$"
-  );
-  std::ifstream file(filename);
-
-  std::string line;
-  std::smatch match;
-
-  while (getline(file, line)) {
-    if (!std::regex_search(line, match, map_regex))
+  FileDescriptor fd(open(filename.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd < 0)
+    return;
+
+  // Read the whole file at once (procfs files have no meaningful size):
+  std::vector<char> buffer(1 << 20);
+  std::size_t size = 0;
+  while (1) {
+    if (size == buffer.size())
+      buffer.resize(2 * buffer.size());
+    ssize_t res = read(fd, buffer.data() + size, buffer.size() - size);
+    if (res < 0 && errno == EINTR)
       continue;
-    Vma vma;
-    vma.start  = strtoll(match[1].str().c_str(), nullptr, 16);
-    vma.end    = strtoll(match[2].str().c_str(), nullptr, 16);
-    vma.prot   = 0;
-    if (match[3].str()[0] == 'r')
-      vma.prot |= PROT_READ;
-    if (match[4].str()[0] == 'w')
-      vma.prot |= PROT_WRITE;
-    if (match[5].str()[0] == 'x')
-      vma.prot |= PROT_EXEC;
-    if (match[6].str()[0] == 'p')
-      vma.flags = MAP_PRIVATE;
-    else
-      vma.flags = MAP_SHARED;
-    vma.offset = strtoll(match[7].str().c_str(), nullptr, 16);
-    vma.name   = match[8];
-    this->vmas_.push_back(std::move(vma));
+    if (res <= 0)
+      break;
+    size += res;
   }
+
+  parse_vm_maps(buffer.data(), size, this->vmas_);
+  count_stat(Counter::vmas, this->vmas_.size());
 }
 
 void Process::load_modules()
 {
   /* Derive ELF modules from the VAS layout.
-     The correct way to do this would be to use
-     /proc/${pid}/auxv, AT_BASE and DT_DEBUG.
+
+     When the link map of the dynamic linker can be read, only the VMAs
+     of its objects (the ones containing their dynamic section) are used
+     and the bias is l_addr. Otherwise, every file-backed VMA is a
+     candidate and the bias is derived from its start address.
+
+     The modules are only registered here: their symbols are loaded
+     the first time an address in their range is looked up.
   */
 
-  this->modules_.clear();
+  // The link map is in the memory of the live process:
+  std::vector<LinkMapEntry> link_map;
+  bool linked = !this->image_ && read_link_map(this->pid_, link_map);
+
+  // Keep the modules which are still mapped at the same place:
+  std::vector<Module> old_modules;
+  old_modules.swap(this->modules_);
+
   size_t n = this->vmas_.size();
   for (size_t i = 0; i != n; ++ i) {
 
@@ -113,11 +112,97 @@ void Process::load_modules()
     if (vma.name.empty() || vma.name[0] == '[')
       continue;
 
-    Module module = load_module(vma.start, vma.name);
-    if (!module.name.empty())
-      this->modules_.push_back(std::move(module));
+    Module module;
+    module.name = vma.name;
+    module.start = vma.start;
     while (i + 1 < n && this->vmas_[i + 1].name == vma.name) ++i;
+    module.end = this->vmas_[i].end;
+    // The .bss usually lives in the anonymous VMA following the module:
+    if (i + 1 < n && this->vmas_[i + 1].name.empty()
+        && this->vmas_[i + 1].start == module.end)
+      module.end = this->vmas_[i + 1].end;
+    module.loaded.reset(new std::once_flag());
+
+    if (linked) {
+      auto k = std::find_if(link_map.begin(), link_map.end(),
+        [&module](LinkMapEntry const& entry) {
+          return module.start <= entry.dynamic && entry.dynamic < module.end;
+        });
+      if (k == link_map.end())
+        continue;
+      module.bias = k->bias;
+      module.linked = true;
+    }
+
+    auto j = std::lower_bound(old_modules.begin(), old_modules.end(), module.start,
+      [](Module const& module, std::uint64_t start) {
+        return module.start < start;
+      });
+    if (j != old_modules.end() && j->start == module.start
+        && j->end == module.end && j->name == module.name)
+      module = std::move(*j);
+
+    this->modules_.push_back(std::move(module));
   }
+
+  std::sort(this->modules_.begin(), this->modules_.end(),
+    [](Module const& a, Module const& b) {
+      return a.start < b.start;
+    });
+}
+
+void Process::load_symbols(Module& module) const
+{
+  std::call_once(*module.loaded, [this, &module]() {
+    // Counted apart from the phase which needs the symbols:
+    PhaseTimer timer(Phase::load_symbols);
+    Module loaded = this->module_cache_
+      ? this->module_cache_->load(module.start, module.name)
+      : load_module(module.start, module.name, this->symbol_cache_);
+    if (!module.linked)
+      module.bias = loaded.bias;
+    module.relocatable = loaded.relocatable;
+    module.symbols = loaded.symbols ? std::move(loaded.symbols)
+      : std::make_shared<SymbolIndex>();
+    count_stat(loaded.name.empty() ? Counter::modules_skipped : Counter::modules_opened);
+    count_stat(Counter::symbols, module.symbols->size());
+  });
+}
+
+void Process::load_all_symbols(unsigned jobs)
+{
+  /* One module per task. The largest modules (by mapped size) are started
+     first so that the total time is bounded by the largest symbol table
+     rather than by their sum. Each module is loaded in place in modules_
+     so the result does not depend on the scheduling.
+  */
+  std::size_t n = this->modules_.size();
+  std::vector<std::size_t> order(n);
+  for (std::size_t i = 0; i != n; ++i)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [this](std::size_t a, std::size_t b) {
+    return this->modules_[a].end - this->modules_[a].start
+      > this->modules_[b].end - this->modules_[b].start;
+  });
+
+  if (jobs == 0)
+    jobs = std::max(1u, std::thread::hardware_concurrency());
+  jobs = std::min<std::size_t>(jobs, n);
+  PhaseTimer timer(Phase::load_symbols);
+  std::atomic<std::size_t> next(0);
+  auto worker = [&]() {
+    // The time of the workers is counted by the timer of this thread:
+    PhaseTimer worker_timer(Phase::load_symbols, false);
+    std::size_t i;
+    while ((i = next++) < n)
+      this->load_symbols(this->modules_[order[i]]);
+  };
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < jobs; ++i)
+    threads.push_back(std::thread(worker));
+  worker();
+  for (std::thread& thread : threads)
+    thread.join();
 }
 
 void Process::load_map_file()
@@ -129,41 +214,206 @@ void Process::load_map_file()
 
 void Process::load_map_file(std::string const& map_file)
 {
-  std::ifstream file(map_file);
-  std::string line;
-  while (getline(file, line)) {
+  this->jit_symbols_ = SymbolIndex();
+  this->map_file_ = map_file;
+  this->map_offset_ = 0;
+  this->update_map_file(nullptr);
+  count_stat(Counter::symbol_bytes, this->jit_symbols_.memory());
+}
+
+void Process::load_jitdump(JitDump const& jitdump)
+{
+  this->jit_symbols_ = SymbolIndex();
+  this->map_file_.clear();
+  for (JitDump::Entry const& entry : jitdump.entries()) {
     Symbol symbol;
-    int name_index;
-    if (sscanf(line.c_str(), "%" SCNx64 " %" SCNx64 "%n", &symbol.value, &symbol.size, &name_index) == 2) {
-      while ((std::string::size_type) name_index < line.size() && line[name_index] == ' ')
-        ++name_index;
-      symbol.name = std::string(line.c_str() + name_index);
-      this->jit_symbols_[symbol.value] = std::move(symbol);
+    symbol.value = entry.address;
+    symbol.size = entry.size;
+    symbol.name = entry.name;
+    symbol.name_size = entry.name_size;
+    symbol.flags = SYMBOL_FLAG_CODE;
+    if (!this->jit_symbols_.add(symbol)) {
+      std::cerr << "Too many symbol names in the jitdump, ignoring the others\n";
+      break;
+    }
+  }
+  this->jit_symbols_.build(true);
+  count_stat(Counter::jit_symbols, jitdump.entries().size());
+  count_stat(Counter::symbol_bytes, this->jit_symbols_.memory());
+}
+
+void Process::load_snapshot(Snapshot const& snapshot)
+{
+  this->vmas_ = snapshot.vmas();
+  this->image_ = &snapshot;
+  this->load_modules();
+  this->jit_symbols_ = SymbolIndex();
+  this->map_file_.clear();
+  std::size_t n = snapshot.symbol_count();
+  for (std::size_t i = 0; i != n; ++i)
+    if (!this->jit_symbols_.add(snapshot.symbol(i))) {
+      std::cerr << "Too many symbol names in the snapshot, ignoring the others\n";
+      break;
+    }
+  this->jit_symbols_.build(true);
+  count_stat(Counter::jit_symbols, n);
+  count_stat(Counter::symbol_bytes, this->jit_symbols_.memory());
+}
+
+void Process::load_core(CoreFile const& core)
+{
+  this->vmas_ = core.vmas();
+  this->image_ = &core;
+  count_stat(Counter::vmas, this->vmas_.size());
+}
+
+bool Process::update_map_file(std::vector<Symbol>* added)
+{
+  /* The names are not copied: they reference the mapped file.
+
+     Each line is: "$start $size $name" (hexadecimal). A JIT can reuse an
+     address: the last line wins. Only complete lines are parsed so that
+     we never see a line which is being written.
+  */
+
+  if (this->map_file_.empty())
+    return false;
+  std::unique_ptr<MappedFile> file(new MappedFile());
+  if (!file->open(this->map_file_))
+    return false;
+  if (file->size() > UINT32_MAX) {
+    std::cerr << "Perf map file too large " << this->map_file_ << '\n';
+    return false;
+  }
+  // The file has been recreated (for example by a new process with the
+  // same PID), possibly larger than the parsed part of the old one:
+  if (file->device() != this->map_device_ || file->inode() != this->map_inode_
+      || file->size() < this->map_offset_) {
+    this->jit_symbols_ = SymbolIndex();
+    this->map_offset_ = 0;
+    this->map_device_ = file->device();
+    this->map_inode_ = file->inode();
+  }
+
+  const char* data = file->data();
+  const char* p = data + this->map_offset_;
+  const char* end = (const char*) memrchr(p, '\n', data + file->size() - p);
+  if (!end)
+    return false;
+  ++end;
+
+  std::vector<std::uint64_t> values;
+  std::uint64_t count = 0;
+  while (p != end) {
+    const char* eol = (const char*) std::memchr(p, '\n', end - p);
+
+    std::uint64_t value, size;
+    if (parse_hex_prefixed(p, eol, value) && skip_spaces(p, eol)
+        && parse_hex_prefixed(p, eol, size) && (p == eol || *p == ' ')) {
+      skip_spaces(p, eol);
+      this->jit_symbols_.add_ref(value, size, p - data, eol - p, 0);
+      ++count;
+      if (added)
+        values.push_back(value);
     }
+
+    p = eol + 1;
   }
+  this->map_offset_ = end - data;
+  count_stat(Counter::jit_symbols, count);
+
+  this->jit_symbols_.attach(std::move(file));
+  this->jit_symbols_.build(true);
+
+  if (added) {
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+    for (std::uint64_t value : values) {
+      Symbol symbol;
+      if (this->jit_symbols_.find(value, &symbol, nullptr))
+        added->push_back(symbol);
+    }
+  }
+  return true;
+}
+
+Vma const* Process::find_vma(std::uint64_t address) const
+{
+  auto i = std::upper_bound(vmas_.begin(), vmas_.end(), address,
+    [](std::uint64_t address, Vma const& vma) {
+      return address < vma.start;
+    });
+  if (i == vmas_.begin())
+    return nullptr;
+  --i;
+  if (address >= i->end)
+    return nullptr;
+  return &*i;
+}
+
+Module* Process::find_module(std::uint64_t address) const
+{
+  auto i = std::upper_bound(modules_.begin(), modules_.end(), address,
+    [](std::uint64_t address, Module const& module) {
+      return address < module.start;
+    });
+  if (i == modules_.begin())
+    return nullptr;
+  --i;
+  if (address >= i->end)
+    return nullptr;
+  return &*i;
 }
 
-Symbol const* Process::find_symbol(std::uint64_t address) const
+bool Process::find_symbol(std::uint64_t address, Symbol* symbol, std::uint64_t* offset,
+  std::string const** module_name) const
 {
-  for (Module const& module : modules_) {
-    auto i = module.symbols.find(address);
-    if (i != module.symbols.end())
-      return &i->second;
+  if (this->jit_symbols_.find(address, symbol, offset)) {
+    if (module_name)
+      *module_name = this->map_file_.empty() ? nullptr : &this->map_file_;
+    return true;
   }
-  return nullptr;
+  Module* module = this->find_module(address);
+  if (module == nullptr)
+    return false;
+  this->load_symbols(*module);
+  if (!module->symbols->find(address - module->bias, symbol, offset))
+    return false;
+  if (symbol)
+    symbol->value += module->bias;
+  if (module_name)
+    *module_name = &module->name;
+  return true;
 }
 
-const char* Process::lookup_symbol(std::uint64_t ReferenceValue)
+std::vector<pid_t> find_processes(std::string const& comm)
 {
-  {
-    auto i = this->jit_symbols_.find(ReferenceValue);
-    if (i != this->jit_symbols_.end())
-      return i->second.name.c_str();
+  std::vector<pid_t> pids;
+  DIR* dir = opendir("/proc");
+  if (!dir)
+    return pids;
+  pid_t self = getpid();
+  while (struct dirent* entry = readdir(dir)) {
+    char* end;
+    long pid = std::strtol(entry->d_name, &end, 10);
+    if (*end != '\0' || pid <= 0 || pid == self)
+      continue;
+    std::string filename = std::string("/proc/") + entry->d_name + "/comm";
+    FileDescriptor fd(open(filename.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd < 0)
+      continue;
+    char buffer[64];
+    ssize_t size = read(fd, buffer, sizeof(buffer));
+    if (size <= 0)
+      continue;
+    if (buffer[size - 1] == '\n')
+      --size;
+    if (comm.size() == (std::size_t) size && comm.compare(0, size, buffer, size) == 0)
+      pids.push_back(pid);
   }
-  const Symbol* symbol = this->find_symbol(ReferenceValue);
-  if (symbol != nullptr)
-    return symbol->name.c_str();
-  return nullptr;
+  closedir(dir);
+  std::sort(pids.begin(), pids.end());
+  return pids;
 }
 
 }
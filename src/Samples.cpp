@@ -0,0 +1,91 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <algorithm>
+#include <utility>
+
+#include "unjit.hpp"
+#include "parse.hpp"
+
+namespace unjit {
+
+static void skip_blanks(const char*& p, const char* end)
+{
+  while (p != end && (*p == ' ' || *p == '\t'))
+    ++p;
+}
+
+bool Samples::load(std::string const& filename)
+{
+  MappedFile file;
+  if (!file.open(filename))
+    return false;
+
+  std::vector<std::pair<std::uint64_t, std::uint64_t>> samples;
+  const char* p = file.data();
+  const char* end = p + file.size();
+  while (p != end) {
+    const char* eol = (const char*) std::memchr(p, '\n', end - p);
+    if (!eol)
+      eol = end;
+
+    // "$address [$count]":
+    std::uint64_t address, count = 1;
+    skip_blanks(p, eol);
+    if (parse_hex_prefixed(p, eol, address) && (p == eol || *p == ' ' || *p == '\t')) {
+      skip_blanks(p, eol);
+      if (p != eol && *p >= '0' && *p <= '9') {
+        count = 0;
+        while (p != eol && *p >= '0' && *p <= '9')
+          count = 10 * count + (*p++ - '0');
+      }
+      samples.push_back(std::make_pair(address, count));
+    }
+
+    p = eol == end ? end : eol + 1;
+  }
+
+  // Aggregate the counts by address:
+  std::sort(samples.begin(), samples.end());
+  addresses_.clear();
+  counts_.assign(1, 0);
+  for (auto const& sample : samples) {
+    if (addresses_.empty() || addresses_.back() != sample.first) {
+      addresses_.push_back(sample.first);
+      counts_.push_back(counts_.back());
+    }
+    counts_.back() += sample.second;
+  }
+  return true;
+}
+
+std::uint64_t Samples::count(std::uint64_t start, std::uint64_t size) const
+{
+  if (counts_.empty())
+    return 0;
+  auto begin = std::lower_bound(addresses_.begin(), addresses_.end(), start);
+  auto end = std::lower_bound(begin, addresses_.end(), start + size);
+  return counts_[end - addresses_.begin()] - counts_[begin - addresses_.begin()];
+}
+
+}
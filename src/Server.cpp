@@ -0,0 +1,222 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cerrno>
+#include <cstring>
+#include <cinttypes>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <stdexcept>
+#include <iostream>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "unjit.hpp"
+
+namespace unjit {
+
+Server::Server(std::string path, std::string symbol_cache,
+    std::string cpu, std::string features) :
+  path_(std::move(path)), cpu_(std::move(cpu)), features_(std::move(features)),
+  modules_(std::move(symbol_cache))
+{
+  struct sockaddr_un address;
+  if (path_.size() >= sizeof(address.sun_path))
+    throw std::runtime_error("Socket path too long");
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  std::strcpy(address.sun_path, path_.c_str());
+
+  socket_ = FileDescriptor(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  if (socket_ < 0)
+    throw std::runtime_error("Could not create socket");
+  unlink(path_.c_str());
+  if (bind(socket_, (struct sockaddr*) &address, sizeof(address)) != 0)
+    throw std::runtime_error("Could not bind socket " + path_);
+  if (listen(socket_, 16) != 0)
+    throw std::runtime_error("Could not listen on socket " + path_);
+}
+
+Server::~Server()
+{
+  unlink(path_.c_str());
+}
+
+void Server::run()
+{
+  // A client going away must not kill the server:
+  signal(SIGPIPE, SIG_IGN);
+  while (1) {
+    FileDescriptor client(accept4(socket_, nullptr, nullptr, SOCK_CLOEXEC));
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      throw std::runtime_error("Could not accept connection");
+    }
+    this->handle(client);
+  }
+}
+
+/* Start time of a process (in clock ticks after boot, 0 if unknown) */
+static std::uint64_t start_time(pid_t pid)
+{
+  std::ifstream file("/proc/" + std::to_string(pid) + "/stat");
+  std::string stat;
+  std::getline(file, stat);
+  // The command name (field 2) can contain spaces and parentheses:
+  std::size_t i = stat.rfind(')');
+  if (i == std::string::npos)
+    return 0;
+  std::istringstream fields(stat.substr(i + 1));
+  std::string field;
+  for (int j = 3; j != 22; ++j)
+    fields >> field;
+  std::uint64_t res = 0;
+  fields >> res;
+  return res;
+}
+
+Server::Target* Server::target(pid_t pid, std::uint64_t address)
+{
+  // Forget about dead processes (and the previous users of the PID):
+  if (kill(pid, 0) != 0 && errno == ESRCH) {
+    targets_.erase(pid);
+    return nullptr;
+  }
+  std::uint64_t time = start_time(pid);
+  auto i = targets_.find(pid);
+  if (i != targets_.end() && i->second.start_time != time) {
+    targets_.erase(i);
+    i = targets_.end();
+  }
+
+  if (i == targets_.end()) {
+    Target target;
+    target.start_time = time;
+    target.process.reset(new Process(pid));
+    target.process->set_module_cache(&modules_);
+    target.process->load_vm_maps();
+    target.process->load_modules();
+    target.process->load_map_file();
+    target.disassembler.reset(new Disassembler(*target.process, cpu_, features_));
+    return &(targets_[pid] = std::move(target));
+  }
+
+  // The JIT may have added new symbols since the last request:
+  Target& target = i->second;
+  Process& process = *target.process;
+  std::vector<Symbol> added;
+  process.update_map_file(&added);
+
+  // Reload the VMAs (and modules) when the requested address or the new
+  // JIT-ed code is outside of the known mappings:
+  bool outside = (address != 0 && process.find_vma(address) == nullptr)
+    || std::any_of(added.begin(), added.end(), [&process](Symbol const& symbol) {
+      return process.find_vma(symbol.value) == nullptr;
+    });
+  if (outside) {
+    process.load_vm_maps();
+    process.load_modules();
+  }
+  return &target;
+}
+
+/* Send the status line of a response ("OK" or "ERROR $message") */
+static bool send_status(int fd, std::string const& status)
+{
+  std::string line = status + '\n';
+  const char* p = line.data();
+  std::size_t size = line.size();
+  while (size != 0) {
+    ssize_t res = write(fd, p, size);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0)
+      return false;
+    p += res;
+    size -= res;
+  }
+  return true;
+}
+
+void Server::handle(int fd)
+{
+  std::string request;
+  char c;
+  while (request.size() < 256) {
+    ssize_t res = read(fd, &c, 1);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0 || c == '\n')
+      break;
+    request.push_back(c);
+  }
+
+  int pid;
+  std::uint64_t start, stop;
+  if (sscanf(request.c_str(), "%i %" SCNx64 " %" SCNx64, &pid, &start, &stop) != 3) {
+    std::cerr << "Bad request\n";
+    send_status(fd, "ERROR Bad request");
+    return;
+  }
+  if (start != 0 && stop <= start) {
+    std::cerr << "Bad stop address\n";
+    send_status(fd, "ERROR Bad stop address");
+    return;
+  }
+
+  Target* target;
+  try {
+    target = this->target(pid, start);
+  }
+  catch (std::exception& e) {
+    std::cerr << e.what() << '\n';
+    send_status(fd, std::string("ERROR ") + e.what());
+    return;
+  }
+  if (!target) {
+    std::cerr << "No such process " << pid << '\n';
+    send_status(fd, "ERROR No such process " + std::to_string(pid));
+    return;
+  }
+
+  if (!send_status(fd, "OK"))
+    return;
+  Output stream(fd);
+  if (start != 0)
+    target->disassembler->disassemble(stream, start, stop - start);
+  else {
+    std::vector<Symbol> symbols(
+      target->process->jit_symbols().begin(), target->process->jit_symbols().end());
+    target->disassembler->disassemble(stream, symbols);
+  }
+}
+
+}
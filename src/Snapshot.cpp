@@ -0,0 +1,375 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cerrno>
+#include <cstring>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "unjit.hpp"
+
+namespace unjit {
+
+static const char snapshot_magic[8] = {'U', 'N', 'J', 'I', 'T', 'S', 'N', 'P'};
+static const std::uint32_t snapshot_version = 1;
+static const std::uint32_t no_blob = UINT32_MAX;
+
+struct Snapshot::Header {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t pid;
+  std::uint64_t vma_count;
+  std::uint64_t symbol_count;
+  std::uint64_t blob_count;
+  std::uint64_t vmas_offset;
+  std::uint64_t symbols_offset;
+  std::uint64_t blobs_offset;
+  std::uint64_t strings_offset;
+  std::uint64_t strings_size;
+};
+
+struct Snapshot::VmaRecord {
+  std::uint64_t start, end, offset;
+  std::uint32_t prot, flags;
+  std::uint32_t name, name_size;
+};
+
+struct Snapshot::SymbolRecord {
+  std::uint64_t value, size;
+  std::uint32_t name, name_size;
+  std::uint32_t flags;
+  std::uint32_t blob;
+};
+
+struct Snapshot::BlobRecord {
+  std::uint64_t hash;
+  std::uint64_t offset, size;
+};
+
+namespace {
+
+class SnapshotWriter {
+private:
+  FileDescriptor fd_;
+  std::string filename_, temp_;
+  std::uint64_t offset_ = 0;
+  std::vector<char> strings_;
+public:
+  std::vector<Snapshot::BlobRecord> blobs;
+  // Blobs by hash (for the deduplication):
+  std::unordered_multimap<std::uint64_t, std::uint32_t> blob_index;
+
+  ~SnapshotWriter()
+  {
+    if (!temp_.empty())
+      unlink(temp_.c_str());
+  }
+
+  /* Write in a temporary file which is renamed by commit() so that
+     a failed capture never leaves a partial snapshot */
+  bool open(std::string const& filename)
+  {
+    filename_ = filename;
+    temp_ = filename + ".tmp." + std::to_string(getpid());
+    // Readable as well: the duplicate blobs are compared with the written ones
+    fd_ = FileDescriptor(::open(temp_.c_str(),
+      O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+    if (fd_ < 0)
+      temp_.clear();
+    return fd_ >= 0;
+  }
+
+  bool commit()
+  {
+    if (rename(temp_.c_str(), filename_.c_str()) != 0)
+      return false;
+    temp_.clear();
+    return true;
+  }
+
+  bool write(const void* data, std::size_t size)
+  {
+    const char* p = (const char*) data;
+    while (size) {
+      ssize_t res = ::write(fd_, p, size);
+      if (res < 0 && errno == EINTR)
+        continue;
+      if (res <= 0)
+        return false;
+      p += res;
+      size -= res;
+      offset_ += res;
+    }
+    return true;
+  }
+
+  bool pwrite(const void* data, std::size_t size, std::uint64_t offset)
+  {
+    return ::pwrite(fd_, data, size, offset) == (ssize_t) size;
+  }
+
+  std::uint64_t offset() const { return offset_; }
+
+  /* The string offsets are 32-bit in the records */
+  bool add_string(const char* data, std::size_t size, std::uint32_t& offset)
+  {
+    if (size > UINT32_MAX - strings_.size()) {
+      std::cerr << "Too many names for the snapshot\n";
+      return false;
+    }
+    offset = strings_.size();
+    strings_.insert(strings_.end(), data, data + size);
+    return true;
+  }
+  std::vector<char> const& strings() const { return strings_; }
+
+  /* Add a code blob (or find an identical one) */
+  bool add_blob(const std::uint8_t* code, std::uint64_t size, std::uint32_t& blob)
+  {
+    std::uint64_t hash = hash_bytes(code, size);
+    auto range = blob_index.equal_range(hash);
+    std::vector<std::uint8_t> temp;
+    for (auto i = range.first; i != range.second; ++i) {
+      Snapshot::BlobRecord const& record = blobs[i->second];
+      if (record.size != size)
+        continue;
+      // Check that the content is really the same:
+      temp.resize(size);
+      if (pread(fd_, temp.data(), size, record.offset) == (ssize_t) size
+          && std::memcmp(temp.data(), code, size) == 0) {
+        blob = i->second;
+        return true;
+      }
+    }
+
+    // The blob indices are 32-bit (and no_blob is reserved):
+    if (blobs.size() >= no_blob) {
+      std::cerr << "Too many code blobs for the snapshot\n";
+      return false;
+    }
+    Snapshot::BlobRecord record;
+    record.hash = hash;
+    record.offset = offset_;
+    record.size = size;
+    if (!this->write(code, size))
+      return false;
+    blob = blobs.size();
+    blobs.push_back(record);
+    blob_index.insert(std::make_pair(hash, blob));
+    return true;
+  }
+};
+
+}
+
+bool Snapshot::capture(std::string const& filename, Process const& process)
+{
+  SnapshotWriter writer;
+  if (!writer.open(filename))
+    return false;
+
+  Header header;
+  std::memset(&header, 0, sizeof(header));
+  if (!writer.write(&header, sizeof(header)))
+    return false;
+
+  // Read and write the code:
+  std::vector<Symbol> symbols(process.jit_symbols().begin(), process.jit_symbols().end());
+  std::vector<SymbolRecord> symbol_records(symbols.size());
+  BatchReader reader(process.pid(), &process.vmas(), process.image());
+  std::size_t i = 0;
+  while (i != symbols.size()) {
+    std::size_t j = reader.read(symbols, i, batch_size);
+    for (; i != j; ++i) {
+      Symbol const& symbol = symbols[i];
+      SymbolRecord& record = symbol_records[i];
+      record.value = symbol.value;
+      record.size = symbol.size;
+      if (!writer.add_string(symbol.name, symbol.name_size, record.name))
+        return false;
+      record.name_size = symbol.name_size;
+      record.flags = symbol.flags;
+      record.blob = no_blob;
+      const std::uint8_t* code = symbol.size ? reader.data(symbol.value, symbol.size) : nullptr;
+      if (code && !writer.add_blob(code, symbol.size, record.blob))
+        return false;
+    }
+  }
+
+  std::vector<VmaRecord> vma_records;
+  for (Vma const& vma : process.vmas()) {
+    VmaRecord record;
+    record.start = vma.start;
+    record.end = vma.end;
+    record.offset = vma.offset;
+    record.prot = vma.prot;
+    record.flags = vma.flags;
+    if (!writer.add_string(vma.name.data(), vma.name.size(), record.name))
+      return false;
+    record.name_size = vma.name.size();
+    vma_records.push_back(record);
+  }
+
+  // Write the tables (8-byte aligned):
+  std::uint64_t padding = 0;
+  if (!writer.write(&padding, (8 - writer.offset() % 8) % 8))
+    return false;
+  std::memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+  header.version = snapshot_version;
+  header.pid = process.pid();
+  header.vma_count = vma_records.size();
+  header.symbol_count = symbol_records.size();
+  header.blob_count = writer.blobs.size();
+  header.vmas_offset = writer.offset();
+  if (!writer.write(vma_records.data(), vma_records.size() * sizeof(VmaRecord)))
+    return false;
+  header.symbols_offset = writer.offset();
+  if (!writer.write(symbol_records.data(), symbol_records.size() * sizeof(SymbolRecord)))
+    return false;
+  header.blobs_offset = writer.offset();
+  if (!writer.write(writer.blobs.data(), writer.blobs.size() * sizeof(BlobRecord)))
+    return false;
+  header.strings_offset = writer.offset();
+  header.strings_size = writer.strings().size();
+  if (!writer.write(writer.strings().data(), writer.strings().size()))
+    return false;
+
+  return writer.pwrite(&header, sizeof(header), 0) && writer.commit();
+}
+
+// Check that a table is inside the file:
+static bool check_table(std::uint64_t offset, std::uint64_t count,
+  std::uint64_t size, std::uint64_t file_size)
+{
+  return offset <= file_size && offset % 8 == 0
+    && count <= (file_size - offset) / size;
+}
+
+bool Snapshot::open(std::string const& filename)
+{
+  header_ = nullptr;
+  if (!file_.open(filename) || file_.size() < sizeof(Header))
+    return false;
+  Header const* header = (Header const*) file_.data();
+  std::uint64_t size = file_.size();
+  if (std::memcmp(header->magic, snapshot_magic, sizeof(header->magic)) != 0
+      || header->version != snapshot_version
+      || !check_table(header->vmas_offset, header->vma_count, sizeof(VmaRecord), size)
+      || !check_table(header->symbols_offset, header->symbol_count, sizeof(SymbolRecord), size)
+      || !check_table(header->blobs_offset, header->blob_count, sizeof(BlobRecord), size)
+      || header->strings_offset > size
+      || header->strings_size > size - header->strings_offset)
+    return false;
+
+  vmas_ = (VmaRecord const*) (file_.data() + header->vmas_offset);
+  symbols_ = (SymbolRecord const*) (file_.data() + header->symbols_offset);
+  blobs_ = (BlobRecord const*) (file_.data() + header->blobs_offset);
+  strings_ = file_.data() + header->strings_offset;
+
+  // Validate the references:
+  for (std::uint64_t i = 0; i != header->blob_count; ++i)
+    if (blobs_[i].offset > size || blobs_[i].size > size - blobs_[i].offset)
+      return false;
+  for (std::uint64_t i = 0; i != header->symbol_count; ++i) {
+    SymbolRecord const& record = symbols_[i];
+    if (record.name > header->strings_size
+        || record.name_size > header->strings_size - record.name
+        || (record.blob != no_blob && (record.blob >= header->blob_count
+          || blobs_[record.blob].size != record.size)))
+      return false;
+  }
+  for (std::uint64_t i = 0; i != header->vma_count; ++i)
+    if (vmas_[i].name > header->strings_size
+        || vmas_[i].name_size > header->strings_size - vmas_[i].name)
+      return false;
+
+  header_ = header;
+  return true;
+}
+
+pid_t Snapshot::pid() const
+{
+  return header_->pid;
+}
+
+std::vector<Vma> Snapshot::vmas() const
+{
+  std::vector<Vma> res(header_->vma_count);
+  for (std::size_t i = 0; i != res.size(); ++i) {
+    res[i].start = vmas_[i].start;
+    res[i].end = vmas_[i].end;
+    res[i].prot = vmas_[i].prot;
+    res[i].flags = vmas_[i].flags;
+    res[i].offset = vmas_[i].offset;
+    res[i].name.assign(strings_ + vmas_[i].name, vmas_[i].name_size);
+  }
+  return res;
+}
+
+std::size_t Snapshot::symbol_count() const
+{
+  return header_ ? header_->symbol_count : 0;
+}
+
+Symbol Snapshot::symbol(std::size_t i) const
+{
+  Symbol symbol;
+  symbol.value = symbols_[i].value;
+  symbol.size = symbols_[i].size;
+  symbol.name = strings_ + symbols_[i].name;
+  symbol.name_size = symbols_[i].name_size;
+  symbol.flags = symbols_[i].flags;
+  return symbol;
+}
+
+const std::uint8_t* Snapshot::code(std::size_t i) const
+{
+  if (symbols_[i].blob == no_blob)
+    return nullptr;
+  return (const std::uint8_t*) file_.data() + blobs_[symbols_[i].blob].offset;
+}
+
+const std::uint8_t* Snapshot::code(std::uint64_t start, std::uint64_t size) const
+{
+  // The symbols are sorted by address:
+  SymbolRecord const* end = symbols_ + header_->symbol_count;
+  SymbolRecord const* i = std::upper_bound(symbols_, end, start,
+    [](std::uint64_t start, SymbolRecord const& record) {
+      return start < record.value;
+    });
+  if (i == symbols_)
+    return nullptr;
+  --i;
+  if (start - i->value > i->size || size > i->size - (start - i->value))
+    return nullptr;
+  const std::uint8_t* code = this->code(i - symbols_);
+  return code ? code + (start - i->value) : nullptr;
+}
+
+}
@@ -0,0 +1,146 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifdef UNJIT_ENABLE_STATS
+
+#include <cstdio>
+#include <ctime>
+
+#include <algorithm>
+
+#include "unjit.hpp"
+
+namespace unjit {
+
+std::atomic<std::uint64_t> counters[(int) Counter::count];
+
+namespace {
+
+// In nanoseconds:
+std::atomic<std::uint64_t> phase_wall[(int) Phase::count];
+std::atomic<std::uint64_t> phase_cpu[(int) Phase::count];
+std::atomic<std::uint64_t> phase_calls[(int) Phase::count];
+
+const char* const counter_names[] = {
+  "vmas", "modules_opened", "modules_skipped", "modules_shared", "symbols",
+  "jit_symbols", "symbol_bytes", "reads", "read_bytes", "failed_reads",
+  "instructions", "undecodable", "output_bytes",
+};
+
+const char* const phase_names[] = {
+  "total", "load_vm_maps", "load_modules", "load_jit_symbols", "load_symbols",
+  "disassemble",
+};
+
+// Innermost active timer of the thread:
+thread_local PhaseTimer* current_timer = nullptr;
+
+std::uint64_t now(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (std::uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+}
+
+PhaseTimer::PhaseTimer(Phase phase, bool counted) :
+  phase_(phase),
+  outer_(current_timer)
+{
+  active_ = !outer_ || outer_->phase_ != phase;
+  counted_ = active_ && counted;
+  if (active_)
+    current_timer = this;
+  if (counted_) {
+    wall_ = now(CLOCK_MONOTONIC);
+    cpu_ = now(CLOCK_PROCESS_CPUTIME_ID);
+  }
+}
+
+PhaseTimer::~PhaseTimer()
+{
+  if (!active_)
+    return;
+  current_timer = outer_;
+  if (!counted_)
+    return;
+  std::uint64_t wall = now(CLOCK_MONOTONIC) - wall_;
+  std::uint64_t cpu = now(CLOCK_PROCESS_CPUTIME_ID) - cpu_;
+  if (outer_) {
+    outer_->inner_wall_ += wall;
+    outer_->inner_cpu_ += cpu;
+  }
+  // The total includes all the phases:
+  if (phase_ != Phase::total) {
+    wall -= std::min(wall, inner_wall_);
+    cpu -= std::min(cpu, inner_cpu_);
+  }
+  int i = (int) phase_;
+  phase_wall[i].fetch_add(wall, std::memory_order_relaxed);
+  phase_cpu[i].fetch_add(cpu, std::memory_order_relaxed);
+  phase_calls[i].fetch_add(1, std::memory_order_relaxed);
+}
+
+void write_stats(std::ostream& stream, bool json)
+{
+  char line[256];
+  if (json) {
+    stream << "{\"phases\":{";
+    bool first = true;
+    for (int i = 0; i != (int) Phase::count; ++i) {
+      if (!phase_calls[i].load(std::memory_order_relaxed))
+        continue;
+      snprintf(line, sizeof(line), "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f}",
+        first ? "" : ",", phase_names[i], phase_wall[i] * 1e-9, phase_cpu[i] * 1e-9);
+      stream << line;
+      first = false;
+    }
+    stream << "},\"counters\":{";
+    for (int i = 0; i != (int) Counter::count; ++i)
+      stream << (i ? "," : "") << '"' << counter_names[i] << "\":"
+        << counters[i].load(std::memory_order_relaxed);
+    stream << "}}\n";
+    return;
+  }
+
+  snprintf(line, sizeof(line), "%-20s %12s %12s\n", "phase", "wall (ms)", "cpu (ms)");
+  stream << line;
+  for (int i = 0; i != (int) Phase::count; ++i) {
+    if (!phase_calls[i].load(std::memory_order_relaxed))
+      continue;
+    snprintf(line, sizeof(line), "%-20s %12.3f %12.3f\n",
+      phase_names[i], phase_wall[i] * 1e-6, phase_cpu[i] * 1e-6);
+    stream << line;
+  }
+  stream << '\n';
+  for (int i = 0; i != (int) Counter::count; ++i) {
+    snprintf(line, sizeof(line), "%-20s %12" PRIu64 "\n",
+      counter_names[i], (std::uint64_t) counters[i].load(std::memory_order_relaxed));
+    stream << line;
+  }
+}
+
+}
+
+#endif
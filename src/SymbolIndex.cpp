@@ -0,0 +1,414 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+
+#include <algorithm>
+#include <fstream>
+
+#include "unjit.hpp"
+
+namespace unjit {
+
+/* Layout of a saved index
+
+   The header is followed by the starts, sizes, names, name sizes and
+   flags arrays and by the names.
+*/
+struct SymbolIndexHeader {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t reserved;
+  std::uint64_t count;
+  std::uint64_t strings_size;
+};
+
+static const char symbol_index_magic[8] = {'U', 'N', 'J', 'I', 'T', 'S', 'Y', 'M'};
+static const std::uint32_t symbol_index_version = 3;
+
+SymbolIndex::SymbolIndex(SymbolIndex&& that)
+{
+  *this = std::move(that);
+}
+
+SymbolIndex& SymbolIndex::operator=(SymbolIndex&& that)
+{
+  // Moving the vectors does not move their content:
+  count_ = that.count_;
+  sorted_ = that.sorted_;
+  starts_ = that.starts_;
+  sizes_ = that.sizes_;
+  names_ = that.names_;
+  name_sizes_ = that.name_sizes_;
+  flags_ = that.flags_;
+  strings_ = that.strings_;
+  starts_storage_ = std::move(that.starts_storage_);
+  sizes_storage_ = std::move(that.sizes_storage_);
+  names_storage_ = std::move(that.names_storage_);
+  name_sizes_storage_ = std::move(that.name_sizes_storage_);
+  flags_storage_ = std::move(that.flags_storage_);
+  strings_storage_ = std::move(that.strings_storage_);
+  file_ = std::move(that.file_);
+  interned_ = std::move(that.interned_);
+  interned_count_ = that.interned_count_;
+
+  that.count_ = 0;
+  that.sorted_ = 0;
+  that.starts_ = nullptr;
+  that.sizes_ = nullptr;
+  that.names_ = nullptr;
+  that.name_sizes_ = nullptr;
+  that.flags_ = nullptr;
+  that.strings_ = nullptr;
+  that.interned_count_ = 0;
+  return *this;
+}
+
+std::uint32_t SymbolIndex::intern(const char* name, std::uint32_t name_size)
+{
+  /* JITs (and the local symbols of ELF files) reuse a lot of names
+     ("Interpreter", stubs...): they are stored only once. The table
+     (offset + 1 of the names, the pool being NUL-terminated) only lives
+     until the next build(): it is rebuilt from the pool if names are
+     added again after that.
+  */
+  const char* strings = strings_storage_.data();
+  std::vector<std::uint32_t> pool;
+  if (interned_.empty()) {
+    for (std::size_t offset = 0; offset < strings_storage_.size();
+        offset += std::strlen(strings + offset) + 1)
+      pool.push_back(offset + 1);
+    interned_count_ = pool.size();
+  }
+  if (2 * (interned_count_ + 1) > interned_.size()) {
+    std::size_t size = std::max<std::size_t>(1024, 2 * interned_.size());
+    while (size < 2 * (interned_count_ + 1))
+      size *= 2;
+    std::vector<std::uint32_t> table(size);
+    std::size_t mask = table.size() - 1;
+    for (std::vector<std::uint32_t> const* entries : { &interned_, &pool })
+      for (std::uint32_t entry : *entries) {
+        if (entry == 0)
+          continue;
+        const char* value = strings + entry - 1;
+        std::size_t i = hash_bytes(value, std::strlen(value)) & mask;
+        while (table[i] != 0)
+          i = (i + 1) & mask;
+        table[i] = entry;
+      }
+    interned_.swap(table);
+  }
+
+  // A stored name matches if it has the same bytes followed by a NUL:
+  std::size_t mask = interned_.size() - 1;
+  std::size_t i = hash_bytes(name, name_size) & mask;
+  for (; interned_[i] != 0; i = (i + 1) & mask) {
+    const char* value = strings + interned_[i] - 1;
+    if (std::memcmp(value, name, name_size) == 0 && value[name_size] == '\0')
+      return interned_[i] - 1;
+  }
+
+  std::uint32_t offset = strings_storage_.size();
+  strings_storage_.insert(strings_storage_.end(), name, name + name_size);
+  strings_storage_.push_back('\0');
+  interned_[i] = offset + 1;
+  ++interned_count_;
+  return offset;
+}
+
+bool SymbolIndex::add(Symbol const& symbol)
+{
+  if (strings_storage_.size() + symbol.name_size + 1 > UINT32_MAX)
+    return false;
+  std::uint32_t name = this->intern(symbol.name, symbol.name_size);
+  starts_storage_.push_back(symbol.value);
+  sizes_storage_.push_back(symbol.size);
+  names_storage_.push_back(name);
+  name_sizes_storage_.push_back(symbol.name_size);
+  flags_storage_.push_back(symbol.flags);
+  return true;
+}
+
+void SymbolIndex::attach(std::unique_ptr<MappedFile> file)
+{
+  file_ = std::move(file);
+}
+
+void SymbolIndex::add_ref(std::uint64_t value, std::uint64_t size,
+  std::uint32_t name, std::uint32_t name_size, std::uint32_t flags)
+{
+  starts_storage_.push_back(value);
+  sizes_storage_.push_back(size);
+  names_storage_.push_back(name);
+  name_sizes_storage_.push_back(name_size);
+  flags_storage_.push_back(flags);
+}
+
+namespace {
+
+struct Entry {
+  std::uint64_t start, size;
+  std::uint32_t name, name_size, flags;
+  // Order of addition of the new symbols (0 for the old ones):
+  std::size_t age;
+};
+
+// End (excluded) of a symbol, the ones without a size covering their address:
+inline std::uint64_t entry_end(Entry const& entry)
+{
+  return entry.start + std::max<std::uint64_t>(entry.size, 1);
+}
+
+}
+
+void SymbolIndex::build(bool exclusive)
+{
+  /* The first sorted_ symbols of the storage are already sorted (previous
+     build): only the symbols added since then are sorted and merged with
+     the old ones which start after the first new one. The others are left
+     in place so that an update only costs the size of the update in the
+     common case (new code after the old code).
+
+     When two symbols start at the same address, the last one added wins
+     (this is what happens when a JIT reuses an address).
+
+     Without exclusive (ELF symbols), the labels without a size and the
+     symbols contained in another one are dropped, and a symbol with a size
+     is preferred to a label at the same address: the lookup only checks
+     the last symbol starting before an address, which must not hide the
+     function containing it. The whole index is merged again in this mode.
+
+     In exclusive mode, the symbols never overlap: a symbol overlapping a
+     newer one is trimmed (if it starts before it) or dropped. The old
+     symbols are then already disjoint and only the last one before the
+     new ones may overlap them.
+  */
+  std::size_t n = starts_storage_.size();
+  std::size_t sorted = sorted_;
+  auto get = [this](std::size_t i) {
+    Entry entry;
+    entry.start = starts_storage_[i];
+    entry.size = sizes_storage_[i];
+    entry.name = names_storage_[i];
+    entry.name_size = name_sizes_storage_[i];
+    entry.flags = flags_storage_[i];
+    entry.age = 0;
+    return entry;
+  };
+  auto set = [this](std::size_t i, Entry const& entry) {
+    starts_storage_[i] = entry.start;
+    sizes_storage_[i] = entry.size;
+    names_storage_[i] = entry.name;
+    name_sizes_storage_[i] = entry.name_size;
+    flags_storage_[i] = entry.flags;
+  };
+  auto by_start = [](Entry const& a, Entry const& b) {
+    return a.start < b.start;
+  };
+
+  std::size_t m = n;
+  if (sorted != n) {
+    std::vector<Entry> added;
+    added.reserve(n - sorted);
+    for (std::size_t i = sorted; i != n; ++i) {
+      added.push_back(get(i));
+      added.back().age = i - sorted + 1;
+    }
+    std::stable_sort(added.begin(), added.end(), by_start);
+
+    std::size_t first = std::lower_bound(starts_storage_.begin(),
+      starts_storage_.begin() + sorted, added.front().start) - starts_storage_.begin();
+    if (exclusive && first != 0)
+      --first;
+    // The enclosing symbols of the new ones may start anywhere before:
+    if (!exclusive)
+      first = 0;
+    std::vector<Entry> old;
+    old.reserve(sorted - first);
+    for (std::size_t i = first; i != sorted; ++i)
+      old.push_back(get(i));
+
+    // Merge (the old symbol first for a given address so that the new one
+    // replaces it):
+    m = first;
+    std::size_t i = 0, j = 0;
+    std::size_t last_age = 0;
+    // End of the kept symbols (before the last one):
+    std::uint64_t cover = 0, cover_before_last = 0;
+    while (i != old.size() || j != added.size()) {
+      Entry entry = j == added.size()
+        || (i != old.size() && old[i].start <= added[j].start) ? old[i++] : added[j++];
+      bool same = m != first && starts_storage_[m - 1] == entry.start;
+      if (!exclusive) {
+        std::uint64_t end = same ? cover_before_last : cover;
+        bool contained = entry.size == 0 ? entry.start < end
+          : entry.start + entry.size <= end;
+        if (contained || (same && entry.size == 0 && sizes_storage_[m - 1] != 0))
+          continue;
+      }
+      if (same) {
+        --m;
+        cover = cover_before_last;
+      } else if (exclusive && m != first) {
+        Entry last = get(m - 1);
+        if (entry.start < entry_end(last)) {
+          if (entry.age < last_age)
+            continue;
+          last.size = entry.start - last.start;
+          set(m - 1, last);
+        }
+      }
+      last_age = entry.age;
+      cover_before_last = cover;
+      cover = std::max(cover, entry.start + entry.size);
+      set(m++, entry);
+    }
+    starts_storage_.resize(m);
+    sizes_storage_.resize(m);
+    names_storage_.resize(m);
+    name_sizes_storage_.resize(m);
+    flags_storage_.resize(m);
+  }
+  strings_storage_.shrink_to_fit();
+  std::vector<std::uint32_t>().swap(interned_);
+  interned_count_ = 0;
+
+  sorted_ = m;
+  count_ = m;
+  starts_ = starts_storage_.data();
+  sizes_ = sizes_storage_.data();
+  names_ = names_storage_.data();
+  name_sizes_ = name_sizes_storage_.data();
+  flags_ = flags_storage_.data();
+  strings_ = file_ ? file_->data() : strings_storage_.data();
+}
+
+bool SymbolIndex::save(std::string const& filename) const
+{
+  SymbolIndexHeader header;
+  std::memcpy(header.magic, symbol_index_magic, sizeof(header.magic));
+  header.version = symbol_index_version;
+  header.reserved = 0;
+  header.count = count_;
+  header.strings_size = count_ ? strings_storage_.size() : 0;
+  if (file_)
+    return false;
+
+  // Write in a temporary file and rename it so that concurrent runs never
+  // see a partial file:
+  std::string temp = filename + ".tmp." + std::to_string(getpid());
+  {
+    std::ofstream file(temp, std::ios::binary);
+    file.write((const char*) &header, sizeof(header));
+    file.write((const char*) starts_, count_ * sizeof(std::uint64_t));
+    file.write((const char*) sizes_, count_ * sizeof(std::uint64_t));
+    file.write((const char*) names_, count_ * sizeof(std::uint32_t));
+    file.write((const char*) name_sizes_, count_ * sizeof(std::uint32_t));
+    file.write((const char*) flags_, count_ * sizeof(std::uint32_t));
+    file.write(strings_, header.strings_size);
+    if (!file) {
+      unlink(temp.c_str());
+      return false;
+    }
+  }
+  if (rename(temp.c_str(), filename.c_str()) != 0) {
+    unlink(temp.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool SymbolIndex::load(std::string const& filename)
+{
+  std::unique_ptr<MappedFile> file(new MappedFile());
+  if (!file->open(filename) || file->size() < sizeof(SymbolIndexHeader))
+    return false;
+
+  SymbolIndexHeader const* header = (SymbolIndexHeader const*) file->data();
+  if (std::memcmp(header->magic, symbol_index_magic, sizeof(header->magic)) != 0
+      || header->version != symbol_index_version)
+    return false;
+  std::uint64_t count = header->count;
+  std::uint64_t strings_size = header->strings_size;
+  if (count > file->size() || strings_size > file->size()
+      || file->size() != sizeof(SymbolIndexHeader) + 28 * count + strings_size)
+    return false;
+
+  const char* data = file->data() + sizeof(SymbolIndexHeader);
+  const std::uint32_t* names = (const std::uint32_t*) (data + 16 * count);
+  const std::uint32_t* name_sizes = (const std::uint32_t*) (data + 20 * count);
+  for (std::uint64_t i = 0; i != count; ++i)
+    if (names[i] > strings_size || name_sizes[i] > strings_size - names[i])
+      return false;
+
+  *this = SymbolIndex();
+  count_ = count;
+  starts_ = (const std::uint64_t*) data;
+  sizes_ = (const std::uint64_t*) (data + 8 * count);
+  names_ = names;
+  name_sizes_ = name_sizes;
+  flags_ = (const std::uint32_t*) (data + 24 * count);
+  strings_ = data + 28 * count;
+  file_ = std::move(file);
+  return true;
+}
+
+bool SymbolIndex::find(std::uint64_t address, Symbol* symbol, std::uint64_t* offset) const
+{
+  // Last symbol starting at or before the address:
+  const std::uint64_t* i = std::upper_bound(starts_, starts_ + count_, address);
+  if (i == starts_)
+    return false;
+  std::size_t j = (i - starts_) - 1;
+  // Symbols without a size only match their exact address:
+  if (address != starts_[j] && address - starts_[j] >= sizes_[j])
+    return false;
+  if (symbol)
+    *symbol = (*this)[j];
+  if (offset)
+    *offset = address - starts_[j];
+  return true;
+}
+
+std::size_t SymbolIndex::memory() const
+{
+  return starts_storage_.capacity() * sizeof(std::uint64_t)
+    + sizes_storage_.capacity() * sizeof(std::uint64_t)
+    + names_storage_.capacity() * sizeof(std::uint32_t)
+    + name_sizes_storage_.capacity() * sizeof(std::uint32_t)
+    + flags_storage_.capacity() * sizeof(std::uint32_t)
+    + strings_storage_.capacity()
+    + interned_.capacity() * sizeof(std::uint32_t);
+}
+
+std::uint64_t SymbolIndex::high() const
+{
+  std::uint64_t res = 0;
+  for (std::size_t i = 0; i != count_; ++i)
+    res = std::max(res, starts_[i] + std::max<std::uint64_t>(sizes_[i], 1));
+  return res;
+}
+
+}
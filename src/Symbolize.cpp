@@ -0,0 +1,169 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "unjit.hpp"
+#include "parse.hpp"
+
+namespace unjit {
+
+namespace {
+
+// Direct-mapped cache of the symbolized addresses:
+class SymbolizeCache {
+private:
+  static const std::size_t table_size = 1 << 16;
+  // The text is dropped when it becomes larger than this:
+  static const std::size_t max_text_size = 16 << 20;
+  static const std::uint32_t unknown = UINT32_MAX;
+
+  struct Entry {
+    std::uint64_t address;
+    std::uint32_t offset, size; // in text_ (size is unknown for a miss)
+  };
+  Process const& process_;
+  std::vector<Entry> table_;
+  std::vector<char> text_;
+  Output temp_;
+
+  void clear()
+  {
+    for (Entry& entry : table_) {
+      entry.address = 0;
+      entry.size = 0;
+    }
+    text_.clear();
+  }
+
+public:
+  SymbolizeCache(Process const& process) :
+    process_(process), table_(table_size), temp_(-1, 256)
+  {
+    this->clear();
+  }
+
+  /* Write the symbolized address (returns false if it is unknown) */
+  bool write(Output& stream, std::uint64_t address)
+  {
+    Entry& entry = table_[(address * 0x9e3779b97f4a7c15) >> 48];
+    if (entry.address != address || entry.size == 0) {
+      Symbol symbol;
+      std::uint64_t offset;
+      std::string const* module;
+      if (!process_.find_symbol(address, &symbol, &offset, &module)) {
+        entry.address = address;
+        entry.size = unknown;
+        return false;
+      }
+      temp_.clear();
+      temp_.write(symbol.name, symbol.name_size);
+      temp_.write("+0x", 3);
+      temp_.hex(offset);
+      temp_.write(" (", 2);
+      if (module)
+        temp_.write(module->data(), module->size());
+      else
+        temp_.write("[jit]", 5);
+      temp_.put(')');
+      if (text_.size() + temp_.size() > max_text_size)
+        this->clear();
+      entry.address = address;
+      entry.offset = text_.size();
+      entry.size = temp_.size();
+      text_.insert(text_.end(), temp_.data(), temp_.data() + temp_.size());
+    }
+    if (entry.size == unknown)
+      return false;
+    stream.write(text_.data() + entry.offset, entry.size);
+    return true;
+  }
+};
+
+inline bool is_word(char c)
+{
+  return hex_digit(c) >= 0 || c == '_'
+    || (c >= 'g' && c <= 'z') || (c >= 'G' && c <= 'Z');
+}
+
+}
+
+bool symbolize(Output& stream, Process const& process, int fd)
+{
+  SymbolizeCache cache(process);
+  std::vector<char> buffer(1 << 20);
+  std::size_t size = 0;
+  while (1) {
+    if (size == buffer.size())
+      buffer.resize(2 * buffer.size());
+    ssize_t res = read(fd, buffer.data() + size, buffer.size() - size);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res < 0)
+      return false;
+    size += res;
+
+    // Process the complete lines (everything at the end of the input):
+    const char* data = buffer.data();
+    const char* end = data + size;
+    if (res != 0) {
+      const char* eol = (const char*) memrchr(data, '\n', size);
+      end = eol ? eol + 1 : data;
+    }
+
+    const char* p = data;
+    const char* copied = data;
+    while (p != end) {
+      // Find the start of a word:
+      if (!is_word(*p)) {
+        ++p;
+        continue;
+      }
+      const char* word = p;
+      while (p != end && is_word(*p))
+        ++p;
+      // Only whole hexadecimal words (outside of the null page):
+      const char* q = word;
+      std::uint64_t address;
+      if (p - word > 18 || !parse_hex_prefixed(q, p, address) || q != p
+          || address < 0x1000)
+        continue;
+      stream.write(copied, word - copied);
+      if (!cache.write(stream, address))
+        stream.write(word, p - word);
+      copied = p;
+    }
+    stream.write(copied, end - copied);
+    stream.flush();
+
+    size = data + size - end;
+    std::memmove(buffer.data(), end, size);
+    if (res == 0)
+      return true;
+  }
+}
+
+}
@@ -21,15 +21,61 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+#include <cstring>
+
 #include <string>
 #include <iomanip>
 
 #include <sys/mman.h>
 
 #include "unjit.hpp"
+#include "parse.hpp"
 
 namespace unjit {
 
+void parse_vm_maps(const char* data, std::size_t size, std::vector<Vma>& vmas)
+{
+  /* Each line is:
+     "$start-$end $rwxp $offset $major:$minor $inode $name"
+  */
+  const char* end = data + size;
+  const char* p = data;
+  while (p != end) {
+    const char* eol = (const char*) std::memchr(p, '\n', end - p);
+    if (!eol)
+      eol = end;
+
+    Vma vma;
+    std::uint64_t ignored;
+    if (parse_hex(p, eol, vma.start) && skip(p, eol, '-')
+        && parse_hex(p, eol, vma.end) && skip(p, eol, ' ')
+        && eol - p >= 5 && p[4] == ' ') {
+      vma.prot = 0;
+      if (p[0] == 'r')
+        vma.prot |= PROT_READ;
+      if (p[1] == 'w')
+        vma.prot |= PROT_WRITE;
+      if (p[2] == 'x')
+        vma.prot |= PROT_EXEC;
+      vma.flags = p[3] == 'p' ? MAP_PRIVATE : MAP_SHARED;
+      p += 5;
+      if (parse_hex(p, eol, vma.offset) && skip(p, eol, ' ')
+          && parse_hex(p, eol, ignored) && skip(p, eol, ':')
+          && parse_hex(p, eol, ignored) && skip(p, eol, ' ')) {
+        // Inode:
+        while (p != eol && *p >= '0' && *p <= '9')
+          ++p;
+        while (p != eol && *p == ' ')
+          ++p;
+        vma.name.assign(p, eol);
+        vmas.push_back(std::move(vma));
+      }
+    }
+
+    p = eol == end ? end : eol + 1;
+  }
+}
+
 std::ostream& operator<<(std::ostream& stream, Vma const& vma)
 {
   stream << std::setfill('0') << std::setw(16) << std::hex
@@ -0,0 +1,100 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cerrno>
+
+#include <algorithm>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+
+#include "unjit.hpp"
+
+namespace unjit {
+
+void watch(Output& stream, Process& process, Disassembler& disassembler,
+  unsigned interval)
+{
+  // The symbols of a jitdump or a snapshot never change:
+  std::string const& map_file = process.map_file();
+  if (map_file.empty())
+    return;
+
+  // Use inotify to wake up as soon as the JIT writes to the perf map. We
+  // still wake up every interval to notice the process exit (and the
+  // creation of the perf map file). The watch follows the inode: it is
+  // added again when the file is unlinked or renamed (recreated map).
+  FileDescriptor notify(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+  int watch = -1;
+
+  std::vector<Symbol> added;
+  while (1) {
+    if (notify >= 0 && watch < 0)
+      watch = inotify_add_watch(notify, map_file.c_str(),
+        IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+
+    added.clear();
+    process.update_map_file(&added);
+    if (!added.empty()) {
+      // Reload the VMAs (and modules) when the JIT mapped new memory:
+      bool outside = std::any_of(added.begin(), added.end(),
+        [&process](Symbol const& symbol) {
+          return process.find_vma(symbol.value) == nullptr;
+        });
+      if (outside) {
+        process.load_vm_maps();
+        process.load_modules();
+      }
+      disassembler.disassemble(stream, added);
+      stream.flush();
+    }
+
+    if (kill(process.pid(), 0) != 0 && errno == ESRCH)
+      return;
+
+    if (watch >= 0) {
+      struct pollfd fd;
+      fd.fd = notify;
+      fd.events = POLLIN;
+      if (poll(&fd, 1, interval) > 0) {
+        // Drain the events:
+        alignas(struct inotify_event) char buffer[4096];
+        ssize_t res;
+        while ((res = read(notify, buffer, sizeof(buffer))) > 0)
+          for (char* p = buffer; p < buffer + res;) {
+            struct inotify_event const* event = (struct inotify_event const*) p;
+            if (event->mask & (IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+              inotify_rm_watch(notify, watch);
+              watch = -1;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+          }
+      }
+    } else {
+      usleep(interval * 1000);
+    }
+  }
+}
+
+}
@@ -0,0 +1,83 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Small helpers for the hand-written text parsers */
+
+#ifndef UNJIT_PARSE_HPP
+#define UNJIT_PARSE_HPP
+
+#include <cinttypes>
+
+namespace unjit {
+
+static inline int hex_digit(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// Parse a (non-empty) hexadecimal number:
+static inline bool parse_hex(const char*& p, const char* end, std::uint64_t& value)
+{
+  const char* start = p;
+  value = 0;
+  int digit;
+  while (p != end && (digit = hex_digit(*p)) >= 0) {
+    value = (value << 4) | digit;
+    ++p;
+  }
+  return p != start;
+}
+
+// Same with an optional "0x" prefix:
+static inline bool parse_hex_prefixed(const char*& p, const char* end, std::uint64_t& value)
+{
+  if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+    p += 2;
+  return parse_hex(p, end, value);
+}
+
+static inline bool skip(const char*& p, const char* end, char c)
+{
+  if (p == end || *p != c)
+    return false;
+  ++p;
+  return true;
+}
+
+static inline bool skip_spaces(const char*& p, const char* end)
+{
+  const char* start = p;
+  while (p != end && *p == ' ')
+    ++p;
+  return p != start;
+}
+
+}
+
+#endif
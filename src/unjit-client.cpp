@@ -0,0 +1,129 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Thin client for "unjit --serve"
+
+   Usage: unjit-client $socket $pid [$start $stop]
+
+   The response starts with a status line ("OK" or "ERROR $message"). The
+   message of an error is printed on stderr and the exit status is 1.
+
+   This does not link against LLVM so that it starts quickly.
+*/
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static unsigned long long int parse_integer(char const* value)
+{
+  if (value[0] == '0' && value[1] == 'x') {
+    return strtoull(value + 2, NULL, 16);
+  } else {
+    return strtoull(value, NULL, 10);
+  }
+}
+
+int main(int argc, const char** argv)
+{
+  if (argc != 3 && argc != 5) {
+    fprintf(stderr, "Usage: unjit-client socket pid [start stop]\n");
+    return 1;
+  }
+
+  struct sockaddr_un address;
+  if (strlen(argv[1]) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Socket path too long\n");
+    return 1;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, argv[1]);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0) {
+    fprintf(stderr, "Could not connect to %s\n", argv[1]);
+    return 1;
+  }
+
+  char request[128];
+  int len = snprintf(request, sizeof(request), "%llu %llx %llx\n",
+    parse_integer(argv[2]),
+    argc == 5 ? parse_integer(argv[3]) : 0ULL,
+    argc == 5 ? parse_integer(argv[4]) : 0ULL);
+  if (write(fd, request, len) != len) {
+    fprintf(stderr, "Could not send request\n");
+    return 1;
+  }
+
+  char buffer[65536];
+  size_t status_size = 0;
+  int status_done = 0;
+  while (1) {
+    ssize_t res = read(fd, buffer + status_size, sizeof(buffer) - status_size);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res < 0) {
+      fprintf(stderr, "Could not read response\n");
+      return 1;
+    }
+    if (res == 0)
+      break;
+    char* data = buffer;
+    if (!status_done) {
+      // Wait for the whole status line:
+      char* eol = (char*) memchr(buffer + status_size, '\n', res);
+      status_size += res;
+      if (!eol) {
+        if (status_size == sizeof(buffer))
+          break;
+        continue;
+      }
+      *eol = '\0';
+      if (strncmp(buffer, "ERROR", 5) == 0) {
+        fprintf(stderr, "%s\n", buffer[5] == ' ' ? buffer + 6 : buffer);
+        return 1;
+      }
+      if (strcmp(buffer, "OK") != 0)
+        break;
+      status_done = 1;
+      data = eol + 1;
+      res = buffer + status_size - data;
+      status_size = 0;
+    }
+    if (fwrite(data, 1, res, stdout) != (size_t) res)
+      return 1;
+  }
+  if (!status_done) {
+    fprintf(stderr, "Bad response\n");
+    return 1;
+  }
+  close(fd);
+  return 0;
+}
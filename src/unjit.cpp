@@ -22,11 +22,15 @@ THE SOFTWARE.
 */
 
 #include <sys/types.h>
+#include <fcntl.h>
 
 #include <cstdlib> // atoll, exit
 #include <cinttypes>
 
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <stdexcept>
 
 #include <llvm-c/Target.h>
 #include <llvm-c/Disassembler.h>
@@ -40,8 +44,31 @@ THE SOFTWARE.
 
 struct Config {
   pid_t pid = -1;
+  // -p pid1,pid2... and --all-matching comm:
+  std::vector<pid_t> pids;
+  std::string all_matching;
   std::uint64_t start = 0, stop = 0;
   bool all = false;
+  std::string serve;
+  unsigned jobs = 1;
+  std::string symbol_cache;
+  bool watch = false;
+  unsigned interval = 1000;
+  std::string jitdump;
+  std::string snapshot;
+  std::string from_snapshot;
+  std::string core;
+  std::string perf_map;
+  bool dedup = false;
+  bool stats = false;
+  std::string stats_file;
+  std::string batch;
+  bool symbolize = false;
+  std::string samples;
+  std::size_t top = 0;
+  std::string cpu;
+  std::string features;
+  bool analyze = false;
 };
 
 static unsigned long long int parse_integer(char const* value)
@@ -68,10 +95,31 @@ static int parse_config(Config& config, int argc, const char** argv)
   options_description desc("Commandline options");
   desc.add_options()
     ("help,h,?", "help")
-    ("pid,p", value<pid_t>(), "PID of the target process")
+    ("pid,p", value<std::string>(), "PID of the target process (or pid1,pid2...)")
+    ("all-matching", value<std::string>(), "Target all the processes with this command name")
     ("start-address", value<std::string>(), "Address")
     ("stop-address", value<std::string>(), "Address")
     ("all", "Disassemble all symbols")
+    ("serve", value<std::string>(), "Serve requests on this Unix socket")
+    ("jobs,j", value<unsigned>(), "Number of disassembly threads")
+    ("symbol-cache", value<std::string>(), "Cache the module symbols in this directory")
+    ("watch", "Keep disassembling the new JIT-ed symbols")
+    ("interval", value<unsigned>(), "Polling interval for --watch (ms)")
+    ("jitdump", value<std::string>(), "Take the JIT-ed code from this jitdump file")
+    ("snapshot", value<std::string>(), "Save the JIT-ed code and symbols in this file")
+    ("from-snapshot", value<std::string>(), "Disassemble a snapshot file")
+    ("core", value<std::string>(), "Take the memory from this core file")
+    ("perf-map", value<std::string>(), "Take the JIT-ed symbols from this perf map")
+    ("dedup", "Do not disassemble the functions identical to a previous one")
+    ("batch", value<std::string>(), "Disassemble the ranges listed in this file (or -)")
+    ("symbolize", "Symbolize the addresses found in the standard input")
+    ("samples", value<std::string>(), "Annotate with the samples of this file (perf script -F ip)")
+    ("top", value<std::size_t>(), "Only the N JIT-ed functions with the most samples")
+    ("mcpu", value<std::string>(), "CPU model (default: host CPU)")
+    ("mattr", value<std::string>(), "CPU features (+avx2,-sse4.1...)")
+    ("analyze", "Static performance analysis of the code (as a loop body)")
+    ("stats", value<std::string>()->implicit_value(""),
+      "Print timings and counters (as JSON in the given file)")
     ;
   variables_map vm;
   store(command_line_parser(argc, argv).options(desc).run(), vm);
@@ -82,18 +130,217 @@ static int parse_config(Config& config, int argc, const char** argv)
     std::exit(0);
   }
 
-  if (vm.count("pid"))
-    config.pid = vm["pid"].as<pid_t>();
+  if (vm.count("pid")) {
+    std::string const& pids = vm["pid"].as<std::string>();
+    const char* p = pids.c_str();
+    while (1) {
+      char* end;
+      long pid = std::strtol(p, &end, 10);
+      if (end == p || pid <= 0 || (*end != ',' && *end != '\0')) {
+        std::cerr << "Bad PID " << pids << '\n';
+        return 1;
+      }
+      config.pids.push_back(pid);
+      if (*end == '\0')
+        break;
+      p = end + 1;
+    }
+    config.pid = config.pids[0];
+  }
+  if (vm.count("all-matching"))
+    config.all_matching = vm["all-matching"].as<std::string>();
   if (vm.count("start-address"))
     config.start = parse_integer(vm["start-address"].as<std::string>().c_str());
   if (vm.count("stop-address"))
     config.stop = parse_integer(vm["stop-address"].as<std::string>().c_str());
   if (vm.count("all"))
     config.all = true;
+  if (vm.count("jobs"))
+    config.jobs = std::max(vm["jobs"].as<unsigned>(), 1u);
+  if (vm.count("symbol-cache"))
+    config.symbol_cache = vm["symbol-cache"].as<std::string>();
+  if (vm.count("watch"))
+    config.watch = true;
+  if (vm.count("interval"))
+    config.interval = vm["interval"].as<unsigned>();
+  if (vm.count("jitdump"))
+    config.jitdump = vm["jitdump"].as<std::string>();
+  if (vm.count("snapshot"))
+    config.snapshot = vm["snapshot"].as<std::string>();
+  if (vm.count("from-snapshot"))
+    config.from_snapshot = vm["from-snapshot"].as<std::string>();
+  if (vm.count("core"))
+    config.core = vm["core"].as<std::string>();
+  if (vm.count("perf-map"))
+    config.perf_map = vm["perf-map"].as<std::string>();
+  if (vm.count("dedup"))
+    config.dedup = true;
+  if (vm.count("batch"))
+    config.batch = vm["batch"].as<std::string>();
+  if (vm.count("symbolize"))
+    config.symbolize = true;
+  if (vm.count("samples"))
+    config.samples = vm["samples"].as<std::string>();
+  if (vm.count("top"))
+    config.top = vm["top"].as<std::size_t>();
+  if (vm.count("mcpu"))
+    config.cpu = vm["mcpu"].as<std::string>();
+  if (vm.count("mattr"))
+    config.features = vm["mattr"].as<std::string>();
+  if (vm.count("analyze")) {
+    config.analyze = true;
+    config.jobs = 1;
+  }
+  if (vm.count("stats")) {
+    config.stats = true;
+    config.stats_file = vm["stats"].as<std::string>();
+  }
+  if (vm.count("serve"))
+    config.serve = vm["serve"].as<std::string>();
 
   return 0;
 }
 
+namespace {
+
+// Write the statistics when main() returns:
+class StatsReport {
+private:
+  Config const& config_;
+public:
+  StatsReport(Config const& config) : config_(config) {}
+  ~StatsReport();
+};
+
+StatsReport::~StatsReport()
+{
+  if (!config_.stats)
+    return;
+#ifdef UNJIT_ENABLE_STATS
+  if (config_.stats_file.empty()) {
+    unjit::write_stats(std::cerr, false);
+    return;
+  }
+  std::ofstream file(config_.stats_file);
+  unjit::write_stats(file, true);
+  if (!file)
+    std::cerr << "Could not write statistics to " << config_.stats_file << '\n';
+#else
+  std::cerr << "Statistics are not available in this build\n";
+#endif
+}
+
+}
+
+/* Add the code symbols of the modules (with their runtime address) */
+static void add_module_symbols(unjit::Process& process, std::vector<unjit::Symbol>& symbols)
+{
+  unjit::PhaseTimer timer(unjit::Phase::load_symbols);
+  process.load_all_symbols();
+  for (auto const& module : process.modules())
+    for (unjit::Symbol symbol : *module.symbols)
+      if (symbol.flags & SYMBOL_FLAG_CODE) {
+        symbol.value += module.bias;
+        symbols.push_back(symbol);
+      }
+}
+
+/* Disassemble several processes (-p pid1,pid2... or --all-matching)
+
+   The symbols of the modules are loaded once per file for all the
+   processes (see ModuleCache) and the processes are handled one after
+   the other. The output of each process starts with "#pid $pid".
+*/
+static int disassemble_processes(Config const& config)
+{
+  if (!config.jitdump.empty() || !config.snapshot.empty()
+      || !config.from_snapshot.empty() || !config.core.empty()
+      || !config.perf_map.empty() || !config.batch.empty()
+      || config.symbolize || config.watch || !config.samples.empty()) {
+    std::cerr << "This mode needs a single process\n";
+    return 1;
+  }
+  if (config.start != 0 && config.stop <= config.start) {
+    std::cerr << "Bad stop address\n";
+    return 1;
+  }
+  std::vector<pid_t> pids = config.pids;
+  if (!config.all_matching.empty()) {
+    for (pid_t pid : unjit::find_processes(config.all_matching))
+      if (std::find(pids.begin(), pids.end(), pid) == pids.end())
+        pids.push_back(pid);
+    if (pids.empty()) {
+      std::cerr << "No process named " << config.all_matching << '\n';
+      return 1;
+    }
+  }
+
+  unjit::ModuleCache modules(config.symbol_cache);
+  unjit::Output output(STDOUT_FILENO);
+  std::unique_ptr<unjit::Analyzer> analyzer;
+  int res = 0;
+  for (pid_t pid : pids) {
+    unjit::Process process(pid);
+    process.set_module_cache(&modules);
+    {
+      unjit::PhaseTimer timer(unjit::Phase::load_vm_maps);
+      process.load_vm_maps();
+    }
+    if (process.vmas().empty()) {
+      std::cerr << "Could not read the memory map of process " << pid << '\n';
+      res = 1;
+      continue;
+    }
+    {
+      unjit::PhaseTimer timer(unjit::Phase::load_modules);
+      process.load_modules();
+    }
+    {
+      unjit::PhaseTimer timer(unjit::Phase::load_jit_symbols);
+      process.load_map_file();
+    }
+
+    unjit::Disassembler disassembler(process, config.cpu, config.features);
+    if (config.analyze) {
+      if (!analyzer) {
+        try {
+          analyzer.reset(new unjit::Analyzer(disassembler.cpu(), disassembler.features()));
+        } catch (std::runtime_error& e) {
+          std::cerr << e.what() << '\n';
+          return 1;
+        }
+      }
+      disassembler.set_analyzer(analyzer.get());
+    }
+
+    output.write("#pid ");
+    output.dec(pid);
+    output.put('\n');
+
+    if (config.start != 0) {
+      unjit::PhaseTimer timer(unjit::Phase::disassemble);
+      disassembler.disassemble(output, config.start, config.stop - config.start);
+      continue;
+    }
+
+    std::vector<unjit::Symbol> symbols;
+    if (config.all)
+      add_module_symbols(process, symbols);
+    for (unjit::Symbol symbol : process.jit_symbols())
+      symbols.push_back(symbol);
+
+    unjit::CodeDedup dedup;
+    if (config.dedup)
+      disassembler.set_dedup(&dedup);
+    unjit::PhaseTimer timer(unjit::Phase::disassemble);
+    if (config.jobs > 1)
+      unjit::disassemble_parallel(output, disassembler, symbols, config.jobs, config.dedup);
+    else
+      disassembler.disassemble(output, symbols);
+  }
+  return res;
+}
+
 int main(int argc, const char** argv)
 {
   Config config;
@@ -106,7 +353,58 @@ int main(int argc, const char** argv)
     std::cerr << "Unknown option\n";
     return 1;
   }
-  if (config.pid < 0 ) {
+
+  // Destroyed in this order: output, timer, report.
+  StatsReport stats_report(config);
+  unjit::PhaseTimer total_timer(unjit::Phase::total);
+
+  // The jitdump contains the code: the process does not need to be alive.
+  unjit::JitDump jitdump;
+  if (!config.jitdump.empty()) {
+    if (!jitdump.open(config.jitdump)) {
+      std::cerr << "Could not load jitdump " << config.jitdump << '\n';
+      return 1;
+    }
+    if (config.pid < 0)
+      config.pid = jitdump.pid();
+  }
+
+  unjit::Samples samples;
+  if (!config.samples.empty() && !samples.load(config.samples)) {
+    std::cerr << "Could not load samples " << config.samples << '\n';
+    return 1;
+  }
+  if (config.top != 0 && config.samples.empty()) {
+    std::cerr << "--top needs --samples\n";
+    return 1;
+  }
+
+  // The snapshot contains the code as well:
+  unjit::Snapshot snapshot;
+  if (!config.from_snapshot.empty()) {
+    if (!snapshot.open(config.from_snapshot)) {
+      std::cerr << "Could not load snapshot " << config.from_snapshot << '\n';
+      return 1;
+    }
+    config.pid = snapshot.pid();
+  }
+
+  // The core contains the VMAs and the memory (the process is gone):
+  unjit::CoreFile core;
+  if (!config.core.empty()) {
+    if (!core.open(config.core)) {
+      std::cerr << "Could not load core file " << config.core << '\n';
+      return 1;
+    }
+    if (config.pid < 0)
+      config.pid = core.pid();
+    if (config.watch) {
+      std::cerr << "--watch needs a live process\n";
+      return 1;
+    }
+  }
+
+  if (config.pid < 0 && config.serve.empty() && config.all_matching.empty()) {
     std::cerr << "Missing PID\n";
     return 1;
   }
@@ -117,36 +415,219 @@ int main(int argc, const char** argv)
   LLVMInitializeAllDisassemblers();
   LLVMInitializeNativeDisassembler();
 
+  if (!config.serve.empty()) {
+    try {
+      unjit::Server server(config.serve, config.symbol_cache, config.cpu, config.features);
+      server.run();
+    }
+    catch(std::runtime_error& exception) {
+      std::cerr << exception.what() << '\n';
+      return 1;
+    }
+    return 0;
+  }
+
+  if (config.pids.size() > 1 || !config.all_matching.empty())
+    return disassemble_processes(config);
+
   // Get informations about the process:
   unjit::Process process(config.pid);
-  process.load_vm_maps();
-  process.load_modules();
-  process.load_map_file();
+  process.set_symbol_cache(config.symbol_cache);
+  if (!config.from_snapshot.empty()) {
+    unjit::PhaseTimer timer(unjit::Phase::load_jit_symbols);
+    process.load_snapshot(snapshot);
+  } else {
+    {
+      unjit::PhaseTimer timer(unjit::Phase::load_vm_maps);
+      if (config.core.empty())
+        process.load_vm_maps();
+      else
+        process.load_core(core);
+    }
+    {
+      unjit::PhaseTimer timer(unjit::Phase::load_modules);
+      process.load_modules();
+    }
+    unjit::PhaseTimer timer(unjit::Phase::load_jit_symbols);
+    if (!config.jitdump.empty())
+      process.load_jitdump(jitdump);
+    else if (!config.perf_map.empty())
+      process.load_map_file(config.perf_map);
+    else
+      process.load_map_file();
+  }
+
+  if (!config.snapshot.empty()) {
+    if (!unjit::Snapshot::capture(config.snapshot, process)) {
+      std::cerr << "Could not write snapshot " << config.snapshot << '\n';
+      return 1;
+    }
+    return 0;
+  }
+
+  unjit::Disassembler disassembler(process, config.cpu, config.features);
+  std::unique_ptr<unjit::Analyzer> analyzer;
+  if (config.analyze) {
+    try {
+      analyzer.reset(new unjit::Analyzer(disassembler.cpu(), disassembler.features()));
+    } catch (std::runtime_error& e) {
+      std::cerr << e.what() << '\n';
+      return 1;
+    }
+    disassembler.set_analyzer(analyzer.get());
+  }
+  if (!config.samples.empty())
+    disassembler.set_samples(&samples);
+  unjit::Output output(STDOUT_FILENO);
 
-  unjit::Disassembler disassembler(process);
+  if (config.symbolize) {
+    if (!unjit::symbolize(output, process, STDIN_FILENO)) {
+      std::cerr << "Could not read the standard input\n";
+      return 1;
+    }
+    return 0;
+  }
+
+  // Ranges given on the standard input (or in a file):
+  if (!config.batch.empty()) {
+    unjit::PhaseTimer timer(unjit::Phase::disassemble);
+    unjit::FileDescriptor fd;
+    if (config.batch != "-") {
+      fd = unjit::FileDescriptor(open(config.batch.c_str(), O_RDONLY | O_CLOEXEC));
+      if (fd < 0) {
+        std::cerr << "Could not open " << config.batch << '\n';
+        return 1;
+      }
+    }
+    if (!unjit::disassemble_batch(output, process, disassembler,
+        config.batch == "-" ? STDIN_FILENO : (int) fd)) {
+      std::cerr << "Could not read the ranges\n";
+      return 1;
+    }
+    return 0;
+  }
 
   // If a region was given, decompiler it:
   if (config.start != 0) {
+    unjit::PhaseTimer timer(unjit::Phase::disassemble);
     if (config.stop <= config.start) {
       std::cerr << "Bad stop address\n";
       return 1;
     }
-    disassembler.disassemble(std::cout, config.start, config.stop - config.start);
+    if (!config.from_snapshot.empty()) {
+      const uint8_t* code = snapshot.code(config.start, config.stop - config.start);
+      if (!code) {
+        std::cerr << "Region not in the snapshot\n";
+        return 1;
+      }
+      unjit::Symbol symbol;
+      symbol.value = config.start;
+      symbol.size = config.stop - config.start;
+      symbol.name = "_";
+      symbol.name_size = 1;
+      disassembler.disassemble(output, symbol, code);
+      return 0;
+    }
+    // Use the latest code covering this region in the jitdump:
+    auto const& entries = jitdump.entries();
+    for (auto i = entries.rbegin(); i != entries.rend(); ++i)
+      if (i->address <= config.start && config.stop <= i->address + i->size) {
+        unjit::Symbol symbol;
+        symbol.value = config.start;
+        symbol.size = config.stop - config.start;
+        symbol.name = i->name;
+        symbol.name_size = i->name_size;
+        if (config.start != i->address) {
+          symbol.name = "_";
+          symbol.name_size = 1;
+        }
+        disassembler.disassemble(output, symbol, i->code + (config.start - i->address));
+        return 0;
+      }
+    disassembler.disassemble(output, config.start, config.stop - config.start);
     return 0;
   }
 
   // "--all", decompile all symbols from all ELF files.
   // Currently, we don't try to decompile code which is not referenced
   // in the symbol tables.
+  std::vector<unjit::Symbol> symbols;
   if (config.all)
-    for (auto const& module : process.modules())
-      for (auto const& p : module.symbols)
-        if (p.second.flags & SYMBOL_FLAG_CODE)
-          disassembler.disassemble(std::cout, p.second.value, p.second.size);
+    add_module_symbols(process, symbols);
+
+  unjit::CodeDedup dedup;
+  if (config.dedup)
+    disassembler.set_dedup(&dedup);
+
+  unjit::PhaseTimer timer(unjit::Phase::disassemble);
 
   // Decompile all known JIT-ed symbols:
-  for (auto const& k : process.jit_symbols())
-    disassembler.disassemble(std::cout, k.second.value, k.second.size);
+  if (config.jitdump.empty() && config.from_snapshot.empty())
+    for (unjit::Symbol symbol : process.jit_symbols())
+      symbols.push_back(symbol);
+
+  // The code captured in the snapshot or in the jitdump (every version of
+  // the code for the jitdump):
+  std::vector<std::pair<unjit::Symbol, const uint8_t*>> captured;
+  for (std::size_t i = 0; i != snapshot.symbol_count(); ++i) {
+    const uint8_t* code = snapshot.code(i);
+    if (code)
+      captured.push_back(std::make_pair(snapshot.symbol(i), code));
+  }
+  for (auto const& entry : jitdump.entries()) {
+    unjit::Symbol symbol;
+    symbol.value = entry.address;
+    symbol.size = entry.size;
+    symbol.name = entry.name;
+    symbol.name_size = entry.name_size;
+    captured.push_back(std::make_pair(symbol, entry.code));
+  }
+
+  auto disassemble_symbols = [&](std::vector<unjit::Symbol>& symbols) {
+    if (config.jobs > 1)
+      unjit::disassemble_parallel(output, disassembler, symbols, config.jobs, config.dedup);
+    else
+      disassembler.disassemble(output, symbols);
+    symbols.clear();
+  };
+
+  if (config.top == 0) {
+    disassemble_symbols(symbols);
+    for (auto const& function : captured)
+      disassembler.disassemble(output, function.first, function.second);
+  } else {
+    // Keep the hottest symbols and captured functions in a single list
+    // (hottest first):
+    std::size_t n = symbols.size();
+    std::vector<std::pair<std::uint64_t, std::size_t>> hot;
+    for (std::size_t i = 0; i != n + captured.size(); ++i) {
+      unjit::Symbol const& symbol = i < n ? symbols[i] : captured[i - n].first;
+      std::uint64_t count = samples.count(symbol.value, symbol.size);
+      if (count != 0)
+        hot.push_back(std::make_pair(count, i));
+    }
+    std::stable_sort(hot.begin(), hot.end(),
+      [](std::pair<std::uint64_t, std::size_t> const& a,
+        std::pair<std::uint64_t, std::size_t> const& b) {
+        return a.first > b.first;
+      });
+    hot.resize(std::min(hot.size(), config.top));
+
+    // The consecutive symbols of the process are still read together:
+    std::vector<unjit::Symbol> selected;
+    for (auto const& i : hot)
+      if (i.second < n)
+        selected.push_back(symbols[i.second]);
+      else {
+        disassemble_symbols(selected);
+        auto const& function = captured[i.second - n];
+        disassembler.disassemble(output, function.first, function.second);
+      }
+    disassemble_symbols(selected);
+  }
+
+  if (config.watch && config.jitdump.empty() && config.from_snapshot.empty())
+    unjit::watch(output, process, disassembler, config.interval);
 
   return 0;
 }
@@ -26,11 +26,17 @@ THE SOFTWARE.
 
 #include <sys/types.h> // pid_t
 
+#include <atomic>
 #include <cinttypes>  // uint64_t
+#include <cstring>
+#include <stdexcept>
 #include <string>
 #include <memory>     // unique_ptr
+#include <map>
 #include <unordered_map>
+#include <mutex>     // once_flag
 #include <iostream>
+#include <iterator>
 #include <vector>
 
 #include <unistd.h>
@@ -82,14 +88,300 @@ public:
   }
 };
 
+/* Read-only memory mapped file with RAII */
+struct MappedFile {
+private:
+  void* data_;
+  std::size_t size_;
+  dev_t device_ = 0;
+  ino_t inode_ = 0;
+public:
+  MappedFile() : data_(nullptr), size_(0) {}
+  ~MappedFile()
+  {
+    this->close();
+  }
+
+  MappedFile(MappedFile&) = delete;
+  MappedFile& operator=(MappedFile&) = delete;
+
+  /* Map a whole file (returns false on failure) */
+  bool open(std::string const& name);
+  void close();
+
+  const char* data() const
+  {
+    return (const char*) data_;
+  }
+  std::size_t size() const
+  {
+    return size_;
+  }
+
+  /* Identity of the mapped file */
+  dev_t device() const { return device_; }
+  ino_t inode() const { return inode_; }
+};
+
+/* Statistics (unjit --stats)
+
+   The counters are relaxed atomics updated at a coarse granularity (per
+   batch, per function) and the timers are only used around the phases.
+   Without UNJIT_ENABLE_STATS, they compile to nothing.
+*/
+enum class Counter {
+  vmas, modules_opened, modules_skipped, modules_shared, symbols, jit_symbols,
+  symbol_bytes, reads, read_bytes, failed_reads, instructions, undecodable, output_bytes,
+  count
+};
+
+enum class Phase {
+  total, load_vm_maps, load_modules, load_jit_symbols, load_symbols,
+  disassemble, count
+};
+
+#ifdef UNJIT_ENABLE_STATS
+
+extern std::atomic<std::uint64_t> counters[(int) Counter::count];
+
+inline void count_stat(Counter counter, std::uint64_t value = 1)
+{
+  counters[(int) counter].fetch_add(value, std::memory_order_relaxed);
+}
+
+/* Measure the wall and CPU time of a phase (until destruction)
+
+   The timers of a thread nest: the time of an inner phase (module symbols
+   loaded lazily while disassembling) is not counted in the outer phase,
+   and an inner timer of the same phase does nothing. A timer which is not
+   counted only sets the phase of a worker thread whose time is counted by
+   the thread which started it.
+*/
+class PhaseTimer {
+private:
+  Phase phase_;
+  bool active_, counted_;
+  PhaseTimer* outer_;
+  std::uint64_t wall_ = 0, cpu_ = 0;
+  // Time of the inner phases:
+  std::uint64_t inner_wall_ = 0, inner_cpu_ = 0;
+public:
+  explicit PhaseTimer(Phase phase, bool counted = true);
+  ~PhaseTimer();
+  PhaseTimer(PhaseTimer const&) = delete;
+  PhaseTimer& operator=(PhaseTimer const&) = delete;
+};
+
+/* Write the statistics (as text or as a JSON object) */
+void write_stats(std::ostream& stream, bool json);
+
+#else
+
+inline void count_stat(Counter counter, std::uint64_t value = 1) {}
+
+class PhaseTimer {
+public:
+  explicit PhaseTimer(Phase phase, bool counted = true) {}
+};
+
+#endif
+
+/* Buffered output
+
+   A reusable byte buffer with hand-rolled formatting, flushed with
+   write(2) to a file descriptor. Without a file descriptor, the output
+   is kept in memory.
+*/
+class Output {
+private:
+  int fd_;
+  std::vector<char> buffer_;
+  std::size_t size_;
+  bool error_;
+public:
+  explicit Output(int fd = -1, std::size_t capacity = 1 << 20);
+  ~Output();
+
+  Output(Output&) = delete;
+  Output& operator=(Output&) = delete;
+
+  void write(const char* data, std::size_t size)
+  {
+    if (buffer_.size() - size_ < size)
+      this->reserve(size);
+    std::memcpy(buffer_.data() + size_, data, size);
+    size_ += size;
+  }
+  void write(const char* data)
+  {
+    this->write(data, std::strlen(data));
+  }
+  void put(char c)
+  {
+    if (size_ == buffer_.size())
+      this->reserve(1);
+    buffer_[size_++] = c;
+  }
+
+  /* Write a number in lowercase hexadecimal (zero-padded to width) */
+  void hex(std::uint64_t value, unsigned width = 0);
+
+  /* Write a number in decimal */
+  void dec(std::uint64_t value);
+
+  /* Write the buffered data to the file descriptor */
+  bool flush();
+
+  // Buffered data (without file descriptor):
+  const char* data() const { return buffer_.data(); }
+  std::size_t size() const { return size_; }
+  void clear() { size_ = 0; }
+
+  /* True if a write to the file descriptor failed */
+  bool error() const { return error_; }
+private:
+  void reserve(std::size_t size);
+};
+
 #define SYMBOL_FLAG_CODE 1
 
-/* A symbol in the process */
+/* A symbol in the process
+
+   The name is owned by the SymbolIndex containing the symbol and is not
+   necessarily NUL-terminated.
+*/
 struct Symbol {
   std::uint64_t value = 0;
   std::uint64_t size = 0;
-  std::string name;
+  const char* name = nullptr;
+  std::uint32_t name_size = 0;
   std::uint32_t flags = 0;
+
+  std::string name_string() const
+  {
+    return std::string(name, name_size);
+  }
+};
+
+/* Sorted index of symbols
+
+   The symbols are kept in flat arrays sorted by start address so that the
+   symbol containing a given address can be found with a binary search.
+   Symbols are first added with add() and the index is then built with
+   build().
+
+   The names added with add() are interned in a single string pool
+   (identical names are stored once) and referenced by 32-bit offsets: a
+   symbol costs 28 bytes plus its name whatever the number of symbols and
+   there is no allocation per symbol.
+
+   The arrays can be saved in a file and later mapped in memory with
+   load() without any parsing. Alternatively, the names can reference a
+   mapped file given to attach() (see add_ref()).
+*/
+class SymbolIndex {
+private:
+  // Sorted arrays (pointing either to the storage vectors or to a mapped
+  // file):
+  std::size_t count_ = 0;
+  const std::uint64_t* starts_ = nullptr;
+  const std::uint64_t* sizes_ = nullptr;
+  const std::uint32_t* names_ = nullptr; // offsets in strings_
+  const std::uint32_t* name_sizes_ = nullptr;
+  const std::uint32_t* flags_ = nullptr;
+  const char* strings_ = nullptr;
+
+  std::vector<std::uint64_t> starts_storage_;
+  std::vector<std::uint64_t> sizes_storage_;
+  std::vector<std::uint32_t> names_storage_;
+  std::vector<std::uint32_t> name_sizes_storage_;
+  std::vector<std::uint32_t> flags_storage_;
+  std::vector<char> strings_storage_;
+  // Number of (sorted) symbols of the storage at the last build:
+  std::size_t sorted_ = 0;
+  std::unique_ptr<MappedFile> file_;
+  // Names added since the last build (open addressing):
+  std::vector<std::uint32_t> interned_;
+  std::size_t interned_count_ = 0;
+public:
+  class const_iterator {
+  private:
+    SymbolIndex const* index_;
+    std::size_t i_;
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef Symbol value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef Symbol const* pointer;
+    typedef Symbol reference;
+
+    const_iterator(SymbolIndex const* index, std::size_t i) : index_(index), i_(i) {}
+    Symbol operator*() const { return (*index_)[i_]; }
+    const_iterator& operator++() { ++i_; return *this; }
+    bool operator==(const_iterator const& that) const { return i_ == that.i_; }
+    bool operator!=(const_iterator const& that) const { return i_ != that.i_; }
+  };
+
+  SymbolIndex() {}
+  SymbolIndex(SymbolIndex&& that);
+  SymbolIndex& operator=(SymbolIndex&& that);
+  SymbolIndex(SymbolIndex&) = delete;
+  SymbolIndex& operator=(SymbolIndex&) = delete;
+
+  /* Add a symbol (its name is copied)
+
+     Returns false if the names do not fit in the 32-bit offsets.
+  */
+  bool add(Symbol const& symbol);
+
+  /* Sort the symbols added since the last build
+
+     With exclusive, the older symbols overlapping newer ones are trimmed
+     or dropped so that a lookup finds the newest symbol covering an
+     address (reused JIT code memory).
+  */
+  void build(bool exclusive = false);
+
+  /* Use a mapped file as the storage of the names */
+  void attach(std::unique_ptr<MappedFile> file);
+
+  /* Add a symbol whose name is at a given offset in the attached file */
+  void add_ref(std::uint64_t value, std::uint64_t size,
+    std::uint32_t name, std::uint32_t name_size, std::uint32_t flags);
+
+  /* Save the (built) index in a file */
+  bool save(std::string const& filename) const;
+
+  /* Map an index previously saved with save() */
+  bool load(std::string const& filename);
+
+  /* Find the symbol containing a given address */
+  bool find(std::uint64_t address, Symbol* symbol, std::uint64_t* offset) const;
+
+  Symbol operator[](std::size_t i) const
+  {
+    Symbol symbol;
+    symbol.value = starts_[i];
+    symbol.size = sizes_[i];
+    symbol.name = strings_ + names_[i];
+    symbol.name_size = name_sizes_[i];
+    symbol.flags = flags_[i];
+    return symbol;
+  }
+
+  bool empty() const { return count_ == 0; }
+  std::size_t size() const { return count_; }
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, count_); }
+
+  /* Lowest and highest (excluded) covered addresses */
+  std::uint64_t low() const { return count_ ? starts_[0] : 0; }
+  std::uint64_t high() const;
+
+  /* Heap memory used by the index (not counting a mapped file) */
+  std::size_t memory() const;
+private:
+  std::uint32_t intern(const char* name, std::uint32_t name_size);
 };
 
 /* Virtual Memory Area
@@ -106,70 +398,656 @@ struct Vma {
 
 std::ostream& operator<<(std::ostream& stream, Vma const& vma);
 
+/* Parse the content of a /proc/${pid}/maps file (appending to vmas) */
+void parse_vm_maps(const char* data, std::size_t size, std::vector<Vma>& vmas);
+
 /* An ELF file mapped in the process */
 struct Module {
   std::string name;
-  std::unordered_map<std::uint64_t, Symbol> symbols;
+  // Address range covered by the module VMAs:
+  std::uint64_t start = 0, end = 0;
+  // Load bias (the symbols are stored with their ELF values):
+  std::uint64_t bias = 0;
+  // The bias comes from the link map of the dynamic linker:
+  bool linked = false;
+  // ET_DYN (the bias is the address of the first mapping):
+  bool relocatable = false;
+  // Possibly shared with other processes (see ModuleCache):
+  std::shared_ptr<SymbolIndex const> symbols;
+  // Set once the symbols have been loaded (see Process::load_symbols):
+  std::unique_ptr<std::once_flag> loaded;
+};
+
+/* Load the symbols of an ELF module
+
+   When symbol_cache is not empty, the symbols are cached in this
+   directory (keyed by GNU build-id or by file identity) and mapped from
+   the cache in later runs instead of parsing the ELF file.
+*/
+Module load_module(std::uint64_t start, std::string const& name,
+  std::string const& symbol_cache);
+
+/* Symbols of the modules shared by several processes
+
+   The entries are keyed by file identity (device, inode, size and
+   modification time) so that each file is parsed once whatever the
+   number of processes mapping it. They hold the ELF values of the
+   symbols: each process only applies its own bias. Thread-safe.
+*/
+class ModuleCache {
+private:
+  struct Key {
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    time_t mtime;
+    bool operator<(Key const& that) const;
+  };
+  struct Entry {
+    std::once_flag loaded;
+    Module module;
+  };
+  std::string symbol_cache_;
+  mutable std::mutex mutex_;
+  std::map<Key, std::shared_ptr<Entry>> entries_;
+public:
+  explicit ModuleCache(std::string symbol_cache = std::string()) :
+    symbol_cache_(std::move(symbol_cache)) {}
+  ModuleCache(ModuleCache const&) = delete;
+  ModuleCache& operator=(ModuleCache const&) = delete;
+
+  /* Same as load_module() but the symbols are shared */
+  Module load(std::uint64_t start, std::string const& name);
+
+  /* Number of distinct files */
+  std::size_t size() const;
+};
+
+/* An ELF object in the link map of the dynamic linker */
+struct LinkMapEntry {
+  std::string name;
+  std::uint64_t bias; // l_addr
+  std::uint64_t dynamic; // l_ld (address of the dynamic section)
+};
+
+/* Find the ELF objects loaded in a process
+
+   The program headers of the executable are found with /proc/$pid/auxv
+   (AT_PHDR, AT_PHNUM), its DT_DEBUG entry gives the r_debug structure of
+   the dynamic linker and the link_map list is walked in the remote
+   memory. Returns false when this is not possible (static executable,
+   dynamic linker not initialized yet, 32-bit process).
+*/
+bool read_link_map(pid_t pid, std::vector<LinkMapEntry>& entries);
+
+/* Reader for the perf jitdump format (/tmp/jit-${pid}.dump)
+
+   The file is mapped in memory: the names and the code bytes of the
+   entries point into the mapping. Code moves are turned into new entries
+   sharing the code bytes of the moved code. A given address can have
+   several entries (the code at this address changed over time): they are
+   in timestamp order.
+
+   Reference: tools/perf/Documentation/jitdump-specification.txt in Linux.
+*/
+class JitDump {
+public:
+  struct Entry {
+    std::uint64_t timestamp;
+    std::uint64_t address;
+    std::uint64_t size;
+    const char* name;
+    std::uint32_t name_size;
+    const std::uint8_t* code;
+  };
+private:
+  MappedFile file_;
+  pid_t pid_ = -1;
+  std::vector<Entry> entries_;
+public:
+  /* Map and parse a jitdump file (returns false if it is not valid) */
+  bool open(std::string const& filename);
+
+  pid_t pid() const { return pid_; }
+  std::vector<Entry> const& entries() const { return entries_; }
+};
+
+class Process;
+
+/* Memory of a target which is available in place (snapshot, core file)
+
+   When a process has an image, its memory is read from the image instead
+   of the live process (see BatchReader).
+*/
+class MemoryImage {
+public:
+  virtual ~MemoryImage() {}
+
+  /* Data of a range (or null if it is not entirely available) */
+  virtual const std::uint8_t* data(std::uint64_t start, std::uint64_t size) const = 0;
+};
+
+/* Offline snapshot of a process (unjit --snapshot)
+
+   Contains the VMAs, the JIT symbols and the code of the JIT symbols.
+   Identical code blobs are stored only once (content-addressed by hash).
+   The file is mapped in memory and used in place.
+
+   Layout: header, code blobs, VMA table, symbol table, blob table and
+   strings (the tables are written after the code so that the capture can
+   be streamed).
+*/
+class Snapshot : public MemoryImage {
+public:
+  struct Header;
+  struct VmaRecord;
+  struct SymbolRecord;
+  struct BlobRecord;
+private:
+  MappedFile file_;
+  Header const* header_ = nullptr;
+  VmaRecord const* vmas_ = nullptr;
+  SymbolRecord const* symbols_ = nullptr;
+  BlobRecord const* blobs_ = nullptr;
+  const char* strings_ = nullptr;
+public:
+  /* Capture a snapshot of a (loaded) process */
+  static bool capture(std::string const& filename, Process const& process);
+
+  /* Map a snapshot file (returns false if it is not valid) */
+  bool open(std::string const& filename);
+
+  pid_t pid() const;
+  std::vector<Vma> vmas() const;
+  std::size_t symbol_count() const;
+  Symbol symbol(std::size_t i) const;
+
+  /* Code of the i-th symbol (or null if it could not be captured) */
+  const std::uint8_t* code(std::size_t i) const;
+
+  /* Find the code of a range inside a symbol (or null) */
+  const std::uint8_t* code(std::uint64_t start, std::uint64_t size) const;
+
+  const std::uint8_t* data(std::uint64_t start, std::uint64_t size) const override
+  {
+    return this->code(start, size);
+  }
 };
 
-Module load_module(std::uint64_t start, std::string const& name);
+/* ELF core dump of a process (unjit --core)
+
+   The core file is mapped in memory and the code is used in place. The
+   VMAs are the PT_LOAD segments, named with the NT_FILE note. The pages
+   of file mappings which are not in the core (by default, the kernel and
+   gcore do not dump the unmodified ones such as the text of the modules)
+   are taken from the files themselves when they are available.
+*/
+class CoreFile : public MemoryImage {
+private:
+  struct Segment {
+    std::uint64_t start, end;
+    // Part present in the core:
+    const std::uint8_t* data;
+    std::uint64_t size;
+    // Mapped file (or null) and offset of the segment in this file:
+    MappedFile const* file;
+    std::uint64_t offset;
+  };
+  MappedFile core_;
+  pid_t pid_ = -1;
+  std::vector<Vma> vmas_;
+  std::vector<Segment> segments_; // sorted
+  std::map<std::string, std::unique_ptr<MappedFile>> files_;
+public:
+  /* Map a core file (returns false if it is not a supported core file) */
+  bool open(std::string const& filename);
+
+  pid_t pid() const { return pid_; }
+  std::vector<Vma> const& vmas() const { return vmas_; }
+
+  const std::uint8_t* data(std::uint64_t start, std::uint64_t size) const override;
+};
 
 /* Target (disassembled) process */
 class Process {
 private:
   pid_t pid_;
-  std::unordered_map<std::uint64_t, Symbol> jit_symbols_;
+  SymbolIndex jit_symbols_;
   std::vector<Vma> vmas_;
-  std::vector<Module> modules_;
+  // Sorted by start address (symbols loaded lazily):
+  mutable std::vector<Module> modules_;
+  std::string symbol_cache_;
+  ModuleCache* module_cache_ = nullptr;
+  // Memory taken from a snapshot or a core file instead of the process:
+  MemoryImage const* image_ = nullptr;
+  // Perf map file and size of the part already parsed:
+  std::string map_file_;
+  std::uint64_t map_offset_ = 0;
+  // Identity of the parsed perf map file (to detect a new file):
+  dev_t map_device_ = 0;
+  ino_t map_inode_ = 0;
 
 public:
   Process(pid_t pid);
   ~Process();
 
+  /* Set the directory used to cache the symbols of the modules */
+  void set_symbol_cache(std::string directory)
+  {
+    symbol_cache_ = std::move(directory);
+  }
+
+  /* Share the symbols of the modules with other processes */
+  void set_module_cache(ModuleCache* cache)
+  {
+    module_cache_ = cache;
+  }
+
   /* Load virtual address space information (VMAs) */
   void load_vm_maps();
 
-  /** Load informations about each ELF module (symbols) */
+  /** Find the ELF modules (their symbols are loaded on demand) */
   void load_modules();
 
+  /** Load the symbols of all the modules (on jobs threads, 0 for one
+      per CPU) */
+  void load_all_symbols(unsigned jobs = 0);
+
   /* Load JIT symbols from /tmp/perf-${pid}.map */
   void load_map_file();
 
-  /* Load JIT symbols from a perf.map file */
+  /* Load JIT symbols from a perf.map file (replacing the current ones) */
   void load_map_file(std::string const& map_file);
 
-  /* Get symbol name from address */
-  const char* lookup_symbol(uint64_t ReferenceValue);
+  /* Perf map file used for the JIT symbols (empty for a jitdump or a
+     snapshot) */
+  std::string const& map_file() const { return map_file_; }
+
+  /* Load JIT symbols from a jitdump (replacing the current ones)
+
+     When an address was reused, the latest symbol wins.
+  */
+  void load_jitdump(JitDump const& jitdump);
+
+  /* Load the VMAs and JIT symbols of a snapshot (and find the modules) */
+  void load_snapshot(Snapshot const& snapshot);
+
+  /* Use a core file instead of the live process (VMAs and memory)
+
+     The JIT symbols still need to be loaded (for example from a copy of
+     the perf map).
+  */
+  void load_core(CoreFile const& core);
+
+  /* Memory image used instead of the live process (or null) */
+  MemoryImage const* image() const { return image_; }
+
+  /* Load the lines appended to the perf.map file since the last call
+
+     The new (or redefined) symbols are appended to added. Returns true if
+     the symbols changed.
+  */
+  bool update_map_file(std::vector<Symbol>* added);
+
+  /* Find the (JIT or AOT) symbol containing a given address
+
+     The module name is the path of the ELF file or of the perf map (it is
+     set to null for the other JIT symbols).
+  */
+  bool find_symbol(std::uint64_t address, Symbol* symbol, std::uint64_t* offset,
+    std::string const** module_name = nullptr) const;
 
   std::vector<Module> const& modules() const { return modules_; }
 
-  std::unordered_map<std::uint64_t, Symbol> const& jit_symbols()
+  std::vector<Vma> const& vmas() const { return vmas_; }
+
+  /* Find the VMA containing a given address */
+  Vma const* find_vma(std::uint64_t address) const;
+
+  SymbolIndex const& jit_symbols() const
   {
     return jit_symbols_;
   }
 
-  pid_t pid()
+  pid_t pid() const
   {
     return pid_;
   }
 
 private:
-  Symbol const* find_symbol(std::uint64_t address) const;
+  Module* find_module(std::uint64_t address) const;
+  void load_symbols(Module& module) const;
+
+};
+
+/* Find the processes whose command name (/proc/$pid/comm) is comm */
+std::vector<pid_t> find_processes(std::string const& comm);
+
+// Maximum number of bytes read in a single batch:
+const std::uint64_t batch_size = 64 << 20;
+
+/* Fast non-cryptographic 64-bit hash */
+std::uint64_t hash_bytes(const void* data, std::size_t size);
+
+/* A range of the remote address space */
+struct Range {
+  std::uint64_t start = 0;
+  std::uint64_t size = 0;
+};
+
+/* Reads many ranges of the remote process with few syscalls
+
+   The requested ranges are sorted and merged when they are adjacent or
+   overlapping. The resulting extents are read in a single arena with
+   process_vm_readv() calls of up to IOV_MAX remote iovecs each.
+
+   When a read stops inside an extent, the rest of the extent is read in
+   chunks split at the VMA and page boundaries (falling back to
+   /proc/$pid/mem for the pages which process_vm_readv() cannot read) so
+   that only the unreadable pages are lost: they are recorded as holes.
+   The pages read this way are cached for the rest of the batch.
+*/
+class BatchReader {
+private:
+  struct Extent {
+    std::uint64_t start, size;
+    std::size_t offset; // in the arena
+    bool read; // the data is in the arena (except for the holes)
+    bool complete; // without holes
+    const std::uint8_t* mapped; // in the memory image (instead of the arena)
+  };
+  struct Page {
+    std::uint64_t address;
+    bool valid;
+    std::vector<std::uint8_t> data;
+  };
+  pid_t pid_;
+  std::vector<Vma> const* vmas_;
+  MemoryImage const* image_;
+  std::vector<std::uint8_t> arena_;
+  std::vector<Extent> extents_;
+  std::vector<Range> holes_; // sorted
+  std::vector<Page> pages_;
+  std::size_t next_page_ = 0;
+  FileDescriptor mem_;
+  bool mem_opened_ = false;
+
+  void recover(Extent& extent, std::uint64_t done);
+  void read_image();
+  bool read_page(std::uint64_t address, std::uint8_t* data,
+    std::uint64_t size);
+  void add_hole(std::uint64_t start, std::uint64_t size);
+  Extent const* find_extent(std::uint64_t start, std::uint64_t size) const;
+  std::vector<Range>::const_iterator find_hole(std::uint64_t start) const;
+public:
+  /* The (optional) VMAs are used to avoid reading outside of them
+
+     With an image, the ranges are used in place in the image (the ones
+     which are not entirely in the image are copied with holes).
+  */
+  BatchReader(pid_t pid, std::vector<Vma> const* vmas = nullptr,
+      MemoryImage const* image = nullptr) :
+    pid_(pid), vmas_(vmas), image_(image) {}
 
+  /* Read the given ranges (replacing the previously read ones) */
+  void read(Range const* ranges, std::size_t count);
+
+  /* Read the symbols starting at begin, up to max_size bytes (but at
+     least one symbol). Returns the end of the batch.
+  */
+  std::size_t read(std::vector<Symbol> const& symbols,
+    std::size_t begin, std::uint64_t max_size);
+
+  /* Get the data of a range which has been completely read (or null) */
+  const std::uint8_t* data(std::uint64_t start, std::uint64_t size) const;
+
+  /* Get the data of a range which has been partially read (or null)
+
+     The holes in the range are appended to holes (and are filled with
+     zeros in the data).
+  */
+  const std::uint8_t* partial_data(std::uint64_t start, std::uint64_t size,
+    std::vector<Range>& holes) const;
 };
 
+/* Sample counts by address (unjit --samples)
+
+   Each line of the file is an address (as printed by "perf script -F ip")
+   optionally followed by a count (for address histograms).
+*/
+class Samples {
+private:
+  std::vector<std::uint64_t> addresses_;
+  // Cumulative counts (counts_[i] is the count of the addresses before i):
+  std::vector<std::uint64_t> counts_;
+public:
+  /* Load a sample file (returns false if it could not be read) */
+  bool load(std::string const& filename);
+
+  /* Number of samples in [start, start + size) */
+  std::uint64_t count(std::uint64_t start, std::uint64_t size) const;
+
+  std::uint64_t total() const
+  {
+    return counts_.empty() ? 0 : counts_.back();
+  }
+};
+
+/* Table of the code blobs already disassembled
+
+   JITs generate many byte-identical functions (stubs, trampolines, inline
+   caches). The blobs are keyed by hash and size; the code and the name of
+   the first copy are kept so that collisions can be checked.
+*/
+class CodeDedup {
+private:
+  struct Entry {
+    std::uint64_t value, size;
+    std::size_t code, name; // offsets in code_ and names_
+    std::uint32_t name_size;
+  };
+  std::unordered_multimap<std::uint64_t, std::size_t> index_;
+  std::vector<Entry> entries_;
+  std::vector<std::uint8_t> code_;
+  std::vector<char> names_;
+  bool frozen_ = false;
+public:
+  /* Register a blob
+
+     Returns true (and the first copy) when an identical blob is already
+     known. The name of the first copy is valid until the next call. The
+     index of the entry of the blob (new or first copy) is stored in index
+     if given.
+  */
+  bool add(Symbol const& symbol, const std::uint8_t* code, Symbol* first,
+    std::size_t* index = nullptr);
+
+  /* Stored copy of the code of an entry (valid until the next add) */
+  const std::uint8_t* code(std::size_t index) const
+  {
+    return code_.data() + entries_[index].code;
+  }
+
+  /* Stop adding new blobs: the table can then be shared by threads */
+  void freeze() { frozen_ = true; }
+};
+
+/* Name and features of the host CPU (as understood by LLVM) */
+void host_cpu(std::string& cpu, std::string& features);
+
+/* Static performance analysis of a range of code (with the scheduling model
+   of the CPU), considered as the body of a loop */
+#ifdef UNJIT_ENABLE_ANALYZER
+
+class Analyzer {
+private:
+  struct Impl;
+  std::unique_ptr<Impl> impl_;
+public:
+  Analyzer(std::string const& cpu, std::string const& features);
+  ~Analyzer();
+  Analyzer(Analyzer const&) = delete;
+  Analyzer& operator=(Analyzer const&) = delete;
+
+  void analyze(Output& stream, Symbol const& symbol, const std::uint8_t* code);
+};
+
+#else
+
+// Built without the analyzer (it needs the LLVM C++ MC API, see CMakeLists.txt):
+class Analyzer {
+public:
+  Analyzer(std::string const& cpu, std::string const& features)
+  {
+    throw std::runtime_error("The analyzer is not available in this build");
+  }
+  void analyze(Output& stream, Symbol const& symbol, const std::uint8_t* code) {}
+};
+
+#endif
+
 class Disassembler {
 private:
   Process* process_;
+  std::string cpu_, features_;
   LLVMDisasmContextRef disassembler_;
-  std::vector<std::uint8_t> buffer_;
+  BatchReader reader_;
+  std::string symbol_buffer_;
+  // Target inside a symbol referenced by the current instruction
+  // (" <name+0x48>", written after the instruction as objdump does):
+  std::string target_comment_;
+  CodeDedup* dedup_ = nullptr;
+  Samples const* samples_ = nullptr;
+  Analyzer* analyzer_ = nullptr;
+  std::uint64_t symbol_samples_ = 0; // in the current symbol
 public:
-  Disassembler(Process& process);
+  /* Without a CPU, the host CPU and its features are used */
+  Disassembler(Process& process, std::string const& cpu = std::string(),
+    std::string const& features = std::string());
   ~Disassembler();
-  void disassemble(std::ostream& stream, const char* name, std::uint64_t start, std::uint64_t size);
-  void disassemble(std::ostream& stream, std::uint64_t start, std::uint64_t stop);
+
+  Process& process() const { return *process_; }
+  std::string const& cpu() const { return cpu_; }
+  std::string const& features() const { return features_; }
+  Samples const* samples() const { return samples_; }
+
+  /* Emit a reference to the first copy instead of disassembling the
+     duplicate functions (the text would not be the same anyway because of
+     the relative addresses) */
+  void set_dedup(CodeDedup* dedup) { dedup_ = dedup; }
+
+  /* Annotate each instruction with its sample count and its percentage of
+     the samples of the symbol */
+  void set_samples(Samples const* samples) { samples_ = samples; }
+
+  /* Print the static analysis of the symbols instead of their disassembly */
+  void set_analyzer(Analyzer* analyzer) { analyzer_ = analyzer; }
+
+  /* Symbolize an address referenced by an instruction ("foo+0x1c") */
+  const char* lookup_symbol(std::uint64_t address);
+
+  void disassemble(Output& stream, Symbol const& symbol);
+
+  /* Disassemble a symbol from local code bytes (instead of remote memory) */
+  void disassemble(Output& stream, Symbol const& symbol, const std::uint8_t* code);
+  void disassemble(Output& stream, std::uint64_t start, std::uint64_t stop);
+
+  /* Disassemble many symbols (in the given order) with batched reads */
+  void disassemble(Output& stream, std::vector<Symbol> const& symbols);
+
+  /* Disassemble a symbol read by the given reader, skipping the parts
+     which could not be read: Read::none if none of the code could */
+  enum class Read { all, partial, none };
+  Read disassemble(Output& stream, Symbol const& symbol, BatchReader const& reader);
+private:
+  void disassemble_code(Output& stream, const uint8_t *code, std::uint64_t start, std::size_t size);
+  void write_instruction(Output& stream, const char* text);
+  void disassemble_read(Output& stream, Symbol const& symbol);
+  void write_samples(Output& stream, std::uint64_t count);
+  void write_header(Output& stream, Symbol const& symbol);
+};
+
+/* Follow a running process
+
+   Disassemble the new JIT-ed symbols as they are added to the perf map
+   file until the process exits. The VMAs are reloaded when a new symbol
+   is outside of the known VMAs.
+*/
+void watch(Output& stream, Process& process, Disassembler& disassembler,
+  unsigned interval);
+
+/* Disassemble many address ranges (unjit --batch)
+
+   Each line of the input is "$start $stop" or "$start +$size"
+   (hexadecimal). The ranges available in each read() of the input are
+   read from the process together and the output is flushed after them.
+   The disassembly of each range is delimited:
+
+     #begin $start $stop
+     ...
+     #end $start $stop ok|partial|error
+
+   The parts of a range which could not be read are skipped (as without
+   --batch) and the range ends with "partial".
+
+   Returns false if the input could not be read.
+*/
+bool disassemble_batch(Output& stream, Process& process,
+  Disassembler& disassembler, int fd);
+
+/* Symbolize the addresses found in a text stream (unjit --symbolize)
+
+   Each hexadecimal number (with or without "0x") which is a whole word
+   and falls in a known symbol is replaced by "symbol+0xoffset (module)".
+   The other text is copied as is. Returns false if the input could not
+   be read.
+*/
+bool symbolize(Output& stream, Process const& process, int fd);
+
+/* Disassemble symbols using several threads
+
+   Each worker has its own Disassembler (and LLVM context). The symbols are
+   split in small work items claimed by idle workers so that a huge
+   function does not stall the other ones. The output of each work item is
+   buffered and written in the original order.
+
+   With dedup, the code is hashed first (in order) so that the workers
+   agree on which copy is the first one. The workers use the CPU and the
+   samples of the given disassembler.
+*/
+void disassemble_parallel(Output& stream, Disassembler const& model,
+  std::vector<Symbol> const& symbols, unsigned jobs, bool dedup = false);
+
+/* Resident server
+
+   Keeps the state (VMAs, modules, symbols, disassembler) of each target
+   process across requests. Each client connection sends a single line
+   "$pid $start $stop\n" (addresses in hexadecimal) and receives the
+   disassembly. A null start address requests all the JIT-ed symbols.
+*/
+class Server {
+private:
+  struct Target {
+    std::unique_ptr<Process> process;
+    std::unique_ptr<Disassembler> disassembler;
+    // To notice a new process reusing the PID:
+    std::uint64_t start_time;
+  };
+  std::string path_;
+  std::string cpu_, features_;
+  // Shared by the targets (they often map the same files):
+  ModuleCache modules_;
+  FileDescriptor socket_;
+  std::map<pid_t, Target> targets_;
+public:
+  /* The disassemblers use the given CPU and features (default: host) */
+  Server(std::string path, std::string symbol_cache,
+    std::string cpu = std::string(), std::string features = std::string());
+  ~Server();
+  void run();
 private:
-  void disassemble_code(std::ostream& stream, uint8_t *code, std::uint64_t start, std::size_t size);
+  void handle(int fd);
+  Target* target(pid_t pid, std::uint64_t address);
 };
 
 }
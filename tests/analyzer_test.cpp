@@ -0,0 +1,111 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Check that the branch targets printed by the analyzer match the plain
+   disassembly */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <llvm-c/Target.h>
+#include <llvm-c/Disassembler.h>
+
+#include "../src/unjit.hpp"
+
+/* Targets of the branches in the instruction lines (not the comments) */
+static std::vector<std::uint64_t> branch_targets(unjit::Output const& output)
+{
+  std::vector<std::uint64_t> res;
+  std::string text(output.data(), output.size());
+  std::size_t start = 0;
+  while (start < text.size()) {
+    std::size_t end = text.find('\n', start);
+    if (end == std::string::npos)
+      end = text.size();
+    std::string line = text.substr(start, end - start);
+    start = end + 1;
+    if (line.compare(0, 2, "\t;") == 0)
+      continue;
+    std::size_t i = line.find("call");
+    if (i == std::string::npos)
+      i = line.find("jmp");
+    if (i == std::string::npos)
+      continue;
+    i = line.find("0x", i);
+    if (i != std::string::npos)
+      res.push_back(std::strtoull(line.c_str() + i + 2, nullptr, 16));
+  }
+  return res;
+}
+
+int main()
+{
+  LLVMInitializeAllTargetInfos();
+  LLVMInitializeAllTargetMCs();
+  LLVMInitializeAllDisassemblers();
+  LLVMInitializeNativeDisassembler();
+
+  // call 0x1015; jmp 0x100e; nop...; ret
+  static const std::uint8_t code[] = {
+    0xe8, 0x10, 0x00, 0x00, 0x00,
+    0xeb, 0x07,
+    0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90,
+    0xc3,
+  };
+  unjit::Symbol symbol;
+  symbol.value = 0x1000;
+  symbol.size = sizeof(code);
+  symbol.name = "f";
+  symbol.name_size = 1;
+
+  unjit::Process process(getpid());
+  process.load_vm_maps();
+  unjit::Disassembler disassembler(process);
+  unjit::Output plain;
+  disassembler.disassemble(plain, symbol, code);
+
+  unjit::Analyzer analyzer(disassembler.cpu(), disassembler.features());
+  disassembler.set_analyzer(&analyzer);
+  unjit::Output analyzed;
+  disassembler.disassemble(analyzed, symbol, code);
+
+  std::vector<std::uint64_t> expected = branch_targets(plain);
+  std::vector<std::uint64_t> targets = branch_targets(analyzed);
+  if (expected.size() != 2 || expected[0] != 0x1015 || expected[1] != 0x100e) {
+    std::fprintf(stderr, "Unexpected plain disassembly:\n%.*s",
+      (int) plain.size(), plain.data());
+    return 1;
+  }
+  if (targets != expected) {
+    std::fprintf(stderr, "Branch targets differ from the plain disassembly:\n%.*s",
+      (int) analyzed.size(), analyzed.data());
+    return 1;
+  }
+  return 0;
+}
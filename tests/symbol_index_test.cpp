@@ -0,0 +1,88 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Lookups in a SymbolIndex of overlapping ELF-like symbols */
+
+#include <cstdio>
+
+#include <string>
+
+#include "../src/unjit.hpp"
+
+static unjit::SymbolIndex symbols;
+static int failures = 0;
+
+static void add(std::uint64_t value, std::uint64_t size, const char* name)
+{
+  unjit::Symbol symbol;
+  symbol.value = value;
+  symbol.size = size;
+  symbol.name = name;
+  symbol.name_size = std::strlen(name);
+  symbols.add(symbol);
+}
+
+static void check(std::uint64_t address, const char* name, std::uint64_t offset)
+{
+  unjit::Symbol symbol;
+  std::uint64_t found_offset;
+  bool found = symbols.find(address, &symbol, &found_offset);
+  if (!name) {
+    if (found) {
+      std::fprintf(stderr, "%#llx: found %s, expected nothing\n",
+        (unsigned long long) address, symbol.name_string().c_str());
+      ++failures;
+    }
+    return;
+  }
+  if (!found || symbol.name_string() != name || found_offset != offset) {
+    std::fprintf(stderr, "%#llx: expected %s+%#llx, found %s+%#llx\n",
+      (unsigned long long) address, name, (unsigned long long) offset,
+      found ? symbol.name_string().c_str() : "nothing",
+      found ? (unsigned long long) found_offset : 0ULL);
+    ++failures;
+  }
+}
+
+int main()
+{
+  add(0x1000, 0x100, "function");
+  add(0x1040, 0, "label");           // zero-size label inside the function
+  add(0x1080, 0x10, "nested");       // symbol contained in the function
+  add(0x2000, 0, "alias");           // label at the start of a function
+  add(0x2000, 0x20, "other");
+  add(0x3000, 0, "lone");            // label outside of any function
+  symbols.build();
+
+  check(0x1000, "function", 0);
+  check(0x1040, "function", 0x40);
+  check(0x1048, "function", 0x48);
+  check(0x1088, "function", 0x88);
+  check(0x1090, "function", 0x90);
+  check(0x10ff, "function", 0xff);
+  check(0x1100, nullptr, 0);
+  check(0x2010, "other", 0x10);
+  check(0x3000, "lone", 0);
+  check(0x3001, nullptr, 0);
+  return failures ? 1 : 0;
+}